@@ -1,199 +1,286 @@
 #include <iostream>
+#include <iomanip>
 #include <vector>
-#include <cstring>  // for memcpy
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <thread>
 #include <fstream>
-#include <sstream>
-extern "C" {
-    #include <libavcodec/avcodec.h>
-    #include <libavformat/avformat.h>
-    #include <libavutil/imgutils.h>
-    #include <libavutil/avutil.h>
-    #include <libswscale/swscale.h>
-    #include "moshUtil.h"
-}
-
-std::vector<uint8_t> readFile(const std::string& filename) {
-    std::ifstream in(filename, std::ios::binary);
-    return std::vector<uint8_t>((std::istreambuf_iterator<char>(in)), {});
-}
-void writeFile(const std::string& filename, const std::vector<uint8_t>& data) {
-    std::ofstream out(filename, std::ios::binary);
-    out.write(reinterpret_cast<const char*>(data.data()), data.size());
-}
-int main(int argc, char* argv[]) {
-    MoshType mosh_type = IFRAMERM;
-    const char* output_file = "output.h264";
-    if (argc < 2) {
-        std::cout << "Usage: " << argv[0] << " <video_file>" << std::endl;
-        return 1;
-    }
-    if (std::string(argv[1]) == "-h") {
-        std::cout << "All available options: " << std::endl;
-        std::cout << "-i (i frame removal)(defaults to this if no third argument is provided)" << std::endl;
-        return 1;
-    }
+#include <getopt.h>
+#include "moshPipeline.h"
+#include "moshUtil.h"
+#include "moshStats.h"
 
-    //*********** Check if the second argument is provided for mosh type and set it accordingly*********/
-    if (argc > 2) {
-        // if (std::string(argv[2]) == "-p") {
-        //     mosh_type = PFRAMEDUP;
-        // }
+// "<first>-<last>" or a single "<frame>"
+static bool parseFrameRange(const char* text, FrameRange& range) {
+    char* end = nullptr;
+    unsigned long long first = strtoull(text, &end, 10);
+    if (end == text || *text == '-') {
+        return false;
     }
-    //****************/
-    for (int i = 0; i < argc; ++i) {
-        std::cout << "Argument " << i << ": " << argv[i] << std::endl;
-    }
-
-    const char* input_file = argv[1];
-    // open the input file and allocate the format context
-    AVFormatContext* format_context = nullptr;
-    if (avformat_open_input(&format_context, input_file, nullptr, nullptr ) < 0) {
-        std::cout << "Could not open input file: " << input_file << std::endl;
-        return 2;
-    }
-    std::cout << "Opening video file: " << input_file << std::endl;
-    if (avformat_find_stream_info(format_context, nullptr) < 0) {
-        std::cout << "Could not find stream information" << std::endl;
-        return 3;
-    }
-    std::cout << "Creating output context for: data_moshed.mp4" << std::endl;
-    std::cout << "Finding stream info: " << input_file << std::endl;
-    //here we find the video stream
-    int HEVC_index = -1;
-    for (unsigned int i = 0; i < format_context->nb_streams; ++i) {
-        if (format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && 
-            format_context->streams[i]->codecpar->codec_id == AV_CODEC_ID_H264) {
-            HEVC_index = i;
-            break;
+    unsigned long long last = first;
+    if (*end == '-') {
+        const char* rest = end + 1;
+        last = strtoull(rest, &end, 10);
+        if (end == rest || *rest == '-') {
+            return false;
         }
     }
-
-    if (HEVC_index == -1) {
-        std::cout << "Could not find HVEC stream" << std::endl;
-        return 4;
-    }
-    AVFormatContext* out_format_ctx = nullptr;
-    avformat_alloc_output_context2(&out_format_ctx, nullptr, nullptr, "data_moshed.mp4");
-    AVStream* out_stream = avformat_new_stream(out_format_ctx, nullptr);
-    AVCodecParameters* in_codecpar = format_context->streams[HEVC_index]->codecpar;
-
-    AVCodecParameters* out_codecpar = out_stream->codecpar;
-    AVRational time_base = format_context->streams[HEVC_index]->time_base;
-    out_codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-    out_codecpar->codec_id = AV_CODEC_ID_H264;
-    out_codecpar->width = in_codecpar->width;
-    out_codecpar->height = in_codecpar->height;
-    out_codecpar->format = in_codecpar->format;
-    out_codecpar->codec_tag = 0;
-    out_stream->time_base = time_base;
-    int width = in_codecpar->width;
-    int height = in_codecpar->height;
-
-    
-    std::ofstream out(output_file, std::ios::binary);
-    AVPacket pkt;
-
-    while (av_read_frame(format_context, &pkt) >= 0) {
-        if (pkt.stream_index == HEVC_index) {
-            // Write raw packet data directly (this is still in H264 format inside the MP4)
-            out.write(reinterpret_cast<const char*>(pkt.data), pkt.size);
-        }
-        av_packet_unref(&pkt);
+    if (*end != '\0' || last < first) {
+        return false;
     }
+    range = {static_cast<size_t>(first), static_cast<size_t>(last)};
+    return true;
+}
 
-    out.close();
-
-    std::vector<uint8_t> h264_byte_vector = readFile(output_file);
-    std::vector<uint8_t> h264_byte_output_vector;
-    size_t i = 0;
-    size_t frame_index = 0;
-
-    while (i + 4 < h264_byte_vector.size()) {
-        size_t start = i;
-        size_t start_code_len = 0;
-
-        // Detect NAL start code
-        if (!(h264_byte_vector[i] == 0x00 && h264_byte_vector[i + 1] == 0x00)) {
-            ++i;
-            continue;
-        }
-
-        if (h264_byte_vector[i + 2] == 0x01) {
-            start_code_len = 3;
-        } else if (h264_byte_vector[i + 2] == 0x00 && h264_byte_vector[i + 3] == 0x01) {
-            start_code_len = 4;
-        } else {
-            ++i;
-            continue;
-        }
+static void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [options] <video_file>..." << std::endl;
+    std::cout << "All available options: " << std::endl;
+    std::cout << "-i                     i frame removal (the default)" << std::endl;
+    std::cout << "-p                     p frame duplication (bloom)" << std::endl;
+    std::cout << "-r, --range <a>[-<b>]  frames the mosh applies to, can be repeated (default 100-200)" << std::endl;
+    std::cout << "-n, --repeat <n>       times each p frame in range is repeated with -p (default 10)" << std::endl;
+    std::cout << "-o <file>              output file (single input only, default <input>_moshed.mp4)" << std::endl;
+    std::cout << "-d <dir>               directory for the outputs (default: next to each input)" << std::endl;
+    std::cout << "-m, --manifest <file>  read input paths from <file>, one per line" << std::endl;
+    std::cout << "-j, --jobs <n>         number of files moshed concurrently (default: all cores)" << std::endl;
+    std::cout << "--no-index             don't read or write the .nalidx sidecar for raw .h264 inputs" << std::endl;
+    std::cout << "-s, --stream           live mode: read a pipe/URL (- for stdin), write to stdout (or -o)" << std::endl;
+    std::cout << "-f, --format <name>    output container (default: from the extension, mpegts on stdout)" << std::endl;
+    std::cout << "--stats                print per-stage wall time, bytes/s, NALs/s and peak RSS" << std::endl;
+    std::cout << "--queue <n>            packets buffered between reader and muxer in live mode (default 32)" << std::endl;
+}
 
-        size_t next = i + start_code_len;
+int main(int argc, char* argv[]) {
+    MoshType mosh_type = IFRAMERM;
+    std::string output_file;
+    std::string output_dir;
+    std::vector<std::string> inputs;
+    unsigned threads = std::thread::hardware_concurrency();
+    bool use_index = true;
+    std::vector<FrameRange> ranges;
+    unsigned repeat = 10;
+    bool live = false;
+    std::string output_format;
+    size_t queue_packets = 32;
+    bool print_stats = false;
 
-        while (next + 4 < h264_byte_vector.size()) {
-            if ((h264_byte_vector[next] == 0x00 && h264_byte_vector[next + 1] == 0x00 &&
-                (h264_byte_vector[next + 2] == 0x01 || 
-                (h264_byte_vector[next + 2] == 0x00 && h264_byte_vector[next + 3] == 0x01)))) {
-                break;
+    static const option long_options[] = {
+        {"range", required_argument, nullptr, 'r'},
+        {"repeat", required_argument, nullptr, 'n'},
+        {"manifest", required_argument, nullptr, 'm'},
+        {"jobs", required_argument, nullptr, 'j'},
+        {"no-index", no_argument, nullptr, 'N'},
+        {"stream", no_argument, nullptr, 's'},
+        {"format", required_argument, nullptr, 'f'},
+        {"queue", required_argument, nullptr, 'Q'},
+        {"stats", no_argument, nullptr, 'S'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hipr:n:o:d:m:j:sf:", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'i':
+            mosh_type = IFRAMERM;
+            break;
+        case 'p':
+            mosh_type = PFRAMEDUP;
+            break;
+        case 'r': {
+            FrameRange range;
+            if (!parseFrameRange(optarg, range)) {
+                std::cout << "Invalid frame range: " << optarg << std::endl;
+                return 1;
             }
-            ++next;
+            ranges.push_back(range);
+            break;
         }
-
-        uint8_t nal_type = h264_byte_vector[i + start_code_len] & 0x1F;
-
-        // keep these  NAL types: SPS (7), PPS (8), SEI (6), AUD (9)
-        if (nal_type == 6 || nal_type == 7 || nal_type == 8 || nal_type == 9) {
-            h264_byte_output_vector.insert(
-                h264_byte_output_vector.end(),
-                h264_byte_vector.begin() + i,
-                h264_byte_vector.begin() + next
-            );
+        case 'n': {
+            char* end = nullptr;
+            long value = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || value < 1) {
+                std::cout << "Invalid repeat count: " << optarg << std::endl;
+                return 1;
+            }
+            repeat = static_cast<unsigned>(value);
+            break;
         }
-        // Handle frame NALs (1 = P/B, 5 = IDR/I-frame)
-        else if (nal_type == 1 || nal_type == 5) {
-            bool skip_frame = false;
-
-            if (nal_type == 5) {
-                if (frame_index >= 100 && frame_index <= 200) {
-                    skip_frame = true;
+        case 'o':
+            output_file = optarg;
+            break;
+        case 'd':
+            output_dir = optarg;
+            break;
+        case 'm': {
+            std::ifstream manifest(optarg);
+            if (!manifest) {
+                std::cout << "Could not open manifest: " << optarg << std::endl;
+                return 1;
+            }
+            // one path per line, blank lines and # comments are skipped
+            for (std::string line; std::getline(manifest, line);) {
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
                 }
-                // Always keep frame 0
-                if (frame_index == 0) {
-                    skip_frame = false;
+                if (!line.empty() && line[0] != '#') {
+                    inputs.push_back(line);
                 }
             }
-
-            if (!skip_frame) {
-                h264_byte_output_vector.insert(
-                    h264_byte_output_vector.end(),
-                    h264_byte_vector.begin() + i,
-                    h264_byte_vector.begin() + next
-                );
-            } else {
-                std::cout << "Skipping IDR frame at frame_index: " << frame_index << ", byte: " << i << std::endl;
+            break;
+        }
+        case 'j': {
+            char* end = nullptr;
+            long value = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || value < 1) {
+                std::cout << "Invalid job count: " << optarg << std::endl;
+                return 1;
             }
-
-            ++frame_index;
+            threads = static_cast<unsigned>(value);
+            break;
+        }
+        case 'N':
+            use_index = false;
+            break;
+        case 's':
+            live = true;
+            break;
+        case 'f':
+            output_format = optarg;
+            break;
+        case 'S':
+            print_stats = true;
+            break;
+        case 'Q': {
+            char* end = nullptr;
+            long value = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || value < 1) {
+                std::cout << "Invalid queue size: " << optarg << std::endl;
+                return 1;
+            }
+            queue_packets = static_cast<size_t>(value);
+            break;
+        }
+        default:
+            printUsage(argv[0]);
+            return 1;
         }
-
-        i = next;
+    }
+    for (int i = optind; i < argc; ++i) {
+        inputs.push_back(argv[i]);
+    }
+    if (live) {
+        if (inputs.empty()) {
+            inputs.push_back("-");
+        }
+        if (inputs.size() > 1) {
+            std::cerr << "--stream takes a single input" << std::endl;
+            return 1;
+        }
+        if (output_file.empty()) {
+            output_file = "-";
+        }
+        // a reader that goes away should end the run with an error, not kill it silently
+        signal(SIGPIPE, SIG_IGN);
     }
 
-    // avformat_close_input(&foramt_context);
-    std::cout << "Saved output to: build/" << output_file << std::endl;
-    writeFile(output_file, h264_byte_output_vector);
-
-    //remux using temrinal 
-
-    std::stringstream cmd;
-    cmd << "ffmpeg -y -f h264 -framerate 30 -i output.h264 -c copy data_moshed.mp4";
-
+    if (inputs.empty()) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (!output_file.empty() && inputs.size() > 1) {
+        std::cout << "-o only works with a single input, use -d for batches" << std::endl;
+        return 1;
+    }
+    // stdout has no extension to guess a container from
+    bool to_stdout = output_file == "-";
+    if (output_format.empty() && to_stdout) {
+        output_format = "mpegts";
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (ranges.empty()) {
+        ranges.push_back({100, 200});
+    }
+    std::shared_ptr<const MoshStrategy> strategy = makeMoshStrategy(mosh_type, ranges, repeat);
 
+    std::vector<MoshJob> jobs;
+    for (const std::string& input : inputs) {
+        MoshJob job;
+        job.input_file = input;
+        job.output_file = output_file.empty() ? outputPathFor(input, output_dir) : output_file;
+        // per-frame logging from several workers would just interleave
+        job.verbose = inputs.size() == 1;
+        // a lone file gets every core for its scan, a batch already keeps them busy
+        job.scan_threads = inputs.size() == 1 ? threads : 1;
+        job.use_index = use_index;
+        job.strategy = strategy;
+        job.live = live;
+        job.output_format = output_format;
+        job.queue_packets = queue_packets;
+        // stdout is the video itself in live mode and with -o -
+        job.verbose = job.verbose && !live && !to_stdout;
+        jobs.push_back(job);
+    }
+    if (output_file.empty()) {
+        makeOutputPathsUnique(jobs);
+    }
 
-    // cmd <<"ffmpeg -y -framerate 30 -i output.h264 -c copy data_moshed.mp4";
+    if (jobs.size() == 1) {
+        std::ostream& log = live || to_stdout ? std::cerr : std::cout;
+        log << "Opening video file: " << jobs[0].input_file << std::endl;
+        JobResult result = moshFile(jobs[0]);
+        if (result.status != 0) {
+            log << result.error << std::endl;
+            return result.status;
+        }
+        log << "Saved output to: " << jobs[0].output_file << std::endl;
+        if (print_stats) {
+            printPipelineStats(log, result.stats);
+        }
+        return 0;
+    }
 
-    std::system(cmd.str().c_str());
-    // avio_open(&out_format_ctx->pb, "data_moshed.mp4", AVIO_FLAG_WRITE);
-    // avformat_write_header(out_format_ctx, nullptr);
+    std::cout << "Moshing " << jobs.size() << " files on " << std::min<size_t>(threads, jobs.size())
+              << " threads" << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<JobResult> results = runJobs(jobs, threads);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    return 0;
-}
\ No newline at end of file
+    size_t failed = 0;
+    size_t total_in = 0;
+    for (size_t k = 0; k < jobs.size(); ++k) {
+        const JobResult& result = results[k];
+        total_in += result.bytes_in;
+        std::cout << (result.status == 0 ? "ok     " : "FAILED ") << jobs[k].input_file;
+        if (result.status == 0) {
+            double mb = result.bytes_in / (1024.0 * 1024.0);
+            std::cout << " -> " << jobs[k].output_file << "  " << std::fixed << std::setprecision(1)
+                      << mb << " MiB in " << std::setprecision(2) << result.seconds << " s ("
+                      << std::setprecision(1) << (result.seconds > 0 ? mb / result.seconds : 0.0)
+                      << " MiB/s)";
+        } else {
+            ++failed;
+            std::cout << "  " << result.error;
+        }
+        std::cout << '\n';
+    }
+    double total_mb = total_in / (1024.0 * 1024.0);
+    std::cout << jobs.size() - failed << "/" << jobs.size() << " succeeded, " << std::fixed
+              << std::setprecision(1) << total_mb << " MiB in " << std::setprecision(2) << wall
+              << " s (" << std::setprecision(1) << (wall > 0 ? total_mb / wall : 0.0) << " MiB/s)"
+              << std::endl;
+    if (print_stats) {
+        // stage times are summed over all workers, so they can exceed the wall time above
+        PipelineStats total;
+        for (const JobResult& result : results) {
+            total.add(result.stats);
+        }
+        printPipelineStats(std::cout, total);
+    }
+    return failed == 0 ? 0 : 7;
+}
@@ -0,0 +1,333 @@
+// Benchmarks the scan -> filter -> write pipeline on synthetic H.264 elementary streams, so
+// scanner and filter changes can be compared without any video assets. The streams are built
+// from canned NAL patterns: a real 64x64 baseline SPS/PPS, then per GOP an IDR and P slices
+// whose headers parse but whose slice data is emulation-prevented random bytes. That is
+// enough for the scanner, the mosh strategies and libavformat's h264 demuxer and muxers.
+//
+// The write rows go to a real file in a temporary directory: writev into /dev/null never
+// touches the source pages and would report meaningless throughput.
+//
+// When built with FFmpeg (MOSH_BENCH_PIPELINE) every stream is also written to a temporary
+// .h264 and run through moshFile: raw -> raw (mmap/writev), raw -> .ts (mmap, then mux
+// through libavformat) and that .ts -> .mp4 (demux, filter and mux through libavformat),
+// with the per-stage numbers --stats would print.
+//
+// Usage: MoshBench [size_mib...]   (default 16 64 256)
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "moshStats.h"
+#include "moshUtil.h"
+#include "nalScanner.h"
+#include "spanWriter.h"
+#ifdef MOSH_BENCH_PIPELINE
+#include "moshPipeline.h"
+#endif
+
+struct GopShape {
+    const char* name;
+    size_t gop_length;  // frames per IDR
+    size_t idr_bytes;   // payload of an IDR slice
+    size_t p_bytes;     // average payload of a P slice
+};
+
+// MSB-first bit writer for the few Exp-Golomb fields a parsable header needs
+class BitWriter {
+public:
+    void bits(uint32_t value, int count) {
+        for (int i = count - 1; i >= 0; --i) {
+            bit((value >> i) & 1);
+        }
+    }
+    void ue(uint32_t value) {
+        uint32_t coded = value + 1;
+        int length = 0;
+        while ((coded >> length) > 1) {
+            ++length;
+        }
+        bits(0, length);
+        bits(coded, length + 1);
+    }
+    void se(int32_t value) { ue(value > 0 ? 2 * value - 1 : -2 * value); }
+    // rbsp_stop_one_bit plus zero padding to the byte boundary
+    std::vector<uint8_t> finish() {
+        bit(1);
+        while (used_ != 0) {
+            bit(0);
+        }
+        return bytes_;
+    }
+    void bit(uint32_t b) {
+        if (used_ == 0) {
+            bytes_.push_back(0);
+        }
+        bytes_.back() |= static_cast<uint8_t>(b << (7 - used_));
+        used_ = (used_ + 1) % 8;
+    }
+
+private:
+    std::vector<uint8_t> bytes_;
+    int used_ = 0;
+};
+
+// Appends one NAL with a 4-byte start code, inserting an 0x03 wherever two zero bytes would
+// be followed by 0x00-0x03, as an encoder's emulation prevention does.
+static void appendNal(std::vector<uint8_t>& out, uint8_t header, const std::vector<uint8_t>& rbsp) {
+    static const uint8_t start_code[] = {0x00, 0x00, 0x00, 0x01};
+    out.insert(out.end(), start_code, start_code + 4);
+    out.push_back(header);
+    int zeros = 0;
+    for (uint8_t byte : rbsp) {
+        if (zeros >= 2 && byte <= 0x03) {
+            out.push_back(0x03);
+            zeros = 0;
+        }
+        out.push_back(byte);
+        zeros = byte == 0x00 ? zeros + 1 : 0;
+    }
+}
+
+// Baseline profile, 64x64, frame_num 4 bits, POC type 2 (output order = decode order)
+static std::vector<uint8_t> makeSps() {
+    BitWriter w;
+    w.bits(66, 8);  // profile_idc
+    w.bits(0xC0, 8); // constraint_set0/1
+    w.bits(30, 8);  // level_idc
+    w.ue(0);        // seq_parameter_set_id
+    w.ue(0);        // log2_max_frame_num_minus4
+    w.ue(2);        // pic_order_cnt_type
+    w.ue(1);        // max_num_ref_frames
+    w.bits(0, 1);   // gaps_in_frame_num_value_allowed_flag
+    w.ue(3);        // pic_width_in_mbs_minus1
+    w.ue(3);        // pic_height_in_map_units_minus1
+    w.bits(1, 1);   // frame_mbs_only_flag
+    w.bits(1, 1);   // direct_8x8_inference_flag
+    w.bits(0, 1);   // frame_cropping_flag
+    w.bits(0, 1);   // vui_parameters_present_flag
+    return w.finish();
+}
+
+static std::vector<uint8_t> makePps() {
+    BitWriter w;
+    w.ue(0);      // pic_parameter_set_id
+    w.ue(0);      // seq_parameter_set_id
+    w.bits(0, 1); // entropy_coding_mode_flag (CAVLC)
+    w.bits(0, 1); // bottom_field_pic_order_in_frame_present_flag
+    w.ue(0);      // num_slice_groups_minus1
+    w.ue(0);      // num_ref_idx_l0_default_active_minus1
+    w.ue(0);      // num_ref_idx_l1_default_active_minus1
+    w.bits(0, 1); // weighted_pred_flag
+    w.bits(0, 2); // weighted_bipred_idc
+    w.se(0);      // pic_init_qp_minus26
+    w.se(0);      // pic_init_qs_minus26
+    w.se(0);      // chroma_qp_index_offset
+    w.bits(1, 1); // deblocking_filter_control_present_flag
+    w.bits(0, 1); // constrained_intra_pred_flag
+    w.bits(0, 1); // redundant_pic_cnt_present_flag
+    return w.finish();
+}
+
+// A slice header the h264 parser accepts, followed by `payload` random bytes of "slice data"
+static std::vector<uint8_t> makeSlice(bool idr, uint32_t frame_num, size_t payload, std::mt19937& rng) {
+    BitWriter w;
+    w.ue(0);                      // first_mb_in_slice
+    w.ue(idr ? 7 : 5);            // slice_type: I or P (all slices of the picture)
+    w.ue(0);                      // pic_parameter_set_id
+    w.bits(frame_num & 0xF, 4);   // frame_num
+    if (idr) {
+        w.ue(0);                  // idr_pic_id
+    }
+    for (size_t i = 0; i < payload; ++i) {
+        // skew towards zero bytes so the scanner sees plenty of near misses
+        w.bits((rng() & 7) == 0 ? 0x00 : rng() & 0xFF, 8);
+    }
+    return w.finish();
+}
+
+static std::vector<uint8_t> makeStream(size_t target_bytes, const GopShape& shape, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> out;
+    out.reserve(target_bytes + shape.idr_bytes * 2);
+    const std::vector<uint8_t> sps = makeSps();
+    const std::vector<uint8_t> pps = makePps();
+    for (size_t frame = 0; out.size() < target_bytes; ++frame) {
+        size_t in_gop = frame % shape.gop_length;
+        if (in_gop == 0) {
+            appendNal(out, 0x67, sps);
+            appendNal(out, 0x68, pps);
+            appendNal(out, 0x65, makeSlice(true, 0, shape.idr_bytes, rng));
+        } else {
+            size_t payload = shape.p_bytes / 2 + rng() % shape.p_bytes;
+            appendNal(out, 0x41, makeSlice(false, static_cast<uint32_t>(in_gop), payload, rng));
+        }
+    }
+    return out;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const std::string& label, double seconds, size_t bytes, size_t nals) {
+    double mib = bytes / (1024.0 * 1024.0);
+    std::cout << "  " << std::left << std::setw(22) << label << std::right << std::fixed
+              << std::setprecision(3) << std::setw(9) << seconds << " s" << std::setprecision(1)
+              << std::setw(12) << (seconds > 0 ? mib / seconds : 0.0) << " MiB/s" << std::setprecision(0)
+              << std::setw(13) << (seconds > 0 ? nals / seconds : 0.0) << " NALs/s\n";
+}
+
+#ifdef MOSH_BENCH_PIPELINE
+// Writes the stream to a temporary .h264 and runs the real moshFile over it: raw -> raw
+// (demux = mmap, then scan/filter/write), raw -> .ts (mmap, scan, filter, mux) and the .ts
+// from that -> .mp4, which goes through the demuxer and h264_mp4toannexb packet by packet.
+// The sidecar index is off so every run really scans.
+static void benchPipeline(const std::string& dir, const std::vector<uint8_t>& stream,
+                          std::shared_ptr<const MoshStrategy> strategy, unsigned threads, bool& failed) {
+    std::string input = dir + "/synthetic.h264";
+    int in_fd = open(input.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = in_fd >= 0 && writeSpans(in_fd, stream.data(), {{0, stream.size()}});
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+
+    const std::pair<const char*, const char*> runs[] = {
+        {"synthetic.h264", "moshed.h264"},
+        {"synthetic.h264", "moshed.ts"},
+        {"moshed.ts", "moshed.mp4"},
+    };
+    for (const auto& run : runs) {
+        MoshJob job;
+        job.input_file = dir + "/" + run.first;
+        job.output_file = dir + "/" + run.second;
+        job.verbose = false;
+        job.scan_threads = threads;
+        job.use_index = false;
+        job.strategy = strategy;
+        JobResult result;
+        if (written) {
+            result = moshFile(job);
+        } else {
+            result.status = 2;
+            result.error = "could not write " + input;
+        }
+        std::cout << "  moshFile " << run.first << " -> " << run.second << ": ";
+        if (result.status != 0) {
+            std::cout << "FAILED " << result.error << "\n";
+            failed = true;
+        } else {
+            std::cout << std::fixed << std::setprecision(3) << result.seconds << " s\n";
+            printPipelineStats(std::cout, result.stats);
+        }
+    }
+    for (const auto& run : runs) {
+        unlink((dir + "/" + run.second).c_str());
+    }
+    unlink(input.c_str());
+}
+#endif
+
+// Times writeSpans into a fresh file under `dir`, which is removed again afterwards.
+// Returns a negative time if the file could not be created or written.
+static double timeWrite(const std::string& dir, const std::vector<uint8_t>& stream, const std::vector<Span>& spans) {
+    std::string path = dir + "/write.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        return -1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool ok = writeSpans(fd, stream.data(), spans);
+    double seconds = secondsSince(start);
+    close(fd);
+    unlink(path.c_str());
+    return ok ? seconds : -1;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<size_t> sizes_mib;
+    for (int i = 1; i < argc; ++i) {
+        sizes_mib.push_back(static_cast<size_t>(std::max(1, atoi(argv[i]))));
+    }
+    if (sizes_mib.empty()) {
+        sizes_mib = {16, 64, 256};
+    }
+    const GopShape shapes[] = {
+        {"intra-only", 1, 60000, 0},
+        {"gop-12", 12, 60000, 8000},
+        {"gop-250", 250, 90000, 4000},
+    };
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::shared_ptr<const MoshStrategy> iframe_rm = makeMoshStrategy(IFRAMERM, {{100, 200}}, 1);
+    std::shared_ptr<const MoshStrategy> pframe_dup = makeMoshStrategy(PFRAMEDUP, {{100, 200}}, 10);
+
+    char dir_template[] = "/tmp/moshbench.XXXXXX";
+    if (mkdtemp(dir_template) == nullptr) {
+        std::cout << "could not create a temporary directory" << std::endl;
+        return 1;
+    }
+    const std::string dir = dir_template;
+    bool mismatch = false;
+    bool failed = false;
+#ifndef MOSH_BENCH_PIPELINE
+    std::cout << "built without FFmpeg, skipping the moshFile cases\n";
+#endif
+    for (size_t size_mib : sizes_mib) {
+        for (const GopShape& shape : shapes) {
+            std::vector<uint8_t> stream = makeStream(size_mib << 20, shape, 1234);
+            std::cout << size_mib << " MiB, " << shape.name << "\n";
+
+            auto start = std::chrono::steady_clock::now();
+            std::vector<NalRef> nals = scanNals(stream.data(), stream.size());
+            report("scan", secondsSince(start), stream.size(), nals.size());
+
+            start = std::chrono::steady_clock::now();
+            std::vector<NalRef> parallel = scanNalsParallel(stream.data(), stream.size(), threads);
+            // small streams get fewer threads than asked for, label the row with what really ran
+            unsigned used = parallelScanThreads(stream.size(), threads);
+            report("scan x" + std::to_string(used), secondsSince(start), stream.size(), parallel.size());
+            // the parallel scan has to agree with the serial one exactly
+            bool same = parallel.size() == nals.size();
+            for (size_t k = 0; same && k < nals.size(); ++k) {
+                same = parallel[k].offset == nals[k].offset && parallel[k].length == nals[k].length &&
+                       parallel[k].type == nals[k].type;
+            }
+            if (!same) {
+                std::cout << "  parallel scan does not match the serial scan!\n";
+                mismatch = true;
+            }
+
+            for (const auto& mode : {std::make_pair("iframe-rm", iframe_rm),
+                                     std::make_pair("pframe-dup", pframe_dup)}) {
+                std::vector<Span> spans;
+                size_t frame_index = 0;
+                start = std::chrono::steady_clock::now();
+                moshNals(nals, *mode.second, frame_index, spans, true, false);
+                report(std::string("filter ") + mode.first, secondsSince(start), stream.size(), nals.size());
+
+                size_t out_bytes = 0;
+                for (const Span& span : spans) {
+                    out_bytes += span.length;
+                }
+                double seconds = timeWrite(dir, stream, spans);
+                if (seconds < 0) {
+                    std::cout << "  write " << mode.first << " FAILED\n";
+                    failed = true;
+                } else {
+                    report(std::string("write ") + mode.first, seconds, out_bytes, 0);
+                }
+            }
+#ifdef MOSH_BENCH_PIPELINE
+            benchPipeline(dir, stream, iframe_rm, threads, failed);
+#endif
+        }
+    }
+    rmdir(dir.c_str());
+    std::cout << "peak RSS " << std::fixed << std::setprecision(1) << peakRssBytes() / (1024.0 * 1024.0)
+              << " MiB" << std::endl;
+    return mismatch || failed ? 1 : 0;
+}
@@ -0,0 +1,708 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <set>
+#include <string>
+#include <cstring>  // for memcpy
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <deque>
+#include <thread>
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+    #include <libavutil/avutil.h>
+}
+#include "moshPipeline.h"
+#include "moshUtil.h"
+#include "nalScanner.h"
+#include "spanWriter.h"
+#include "nalIndexCache.h"
+#include "packetQueue.h"
+#include "moshStats.h"
+
+// Fills out_pkt with the spans of pkt. When the kept NALs form one contiguous range the
+// output packet is just a narrowed reference to the input buffer; only a packet with a hole
+// in the middle (a dropped NAL between kept ones) is gathered into a new buffer.
+int buildPacket(const AVPacket* pkt, const std::vector<Span>& spans, AVPacket* out_pkt) {
+    int ret;
+    if (spans.size() == 1 && pkt->buf != nullptr) {
+        if ((ret = av_packet_ref(out_pkt, pkt)) < 0) {
+            return ret;
+        }
+        out_pkt->data += spans[0].offset;
+        out_pkt->size = static_cast<int>(spans[0].length);
+        return 0;
+    }
+    size_t total = 0;
+    for (const Span& span : spans) {
+        total += span.length;
+    }
+    if ((ret = av_new_packet(out_pkt, static_cast<int>(total))) < 0) {
+        return ret;
+    }
+    uint8_t* dst = out_pkt->data;
+    for (const Span& span : spans) {
+        memcpy(dst, pkt->data + span.offset, span.length);
+        dst += span.length;
+    }
+    return av_packet_copy_props(out_pkt, pkt);
+}
+
+// True when `path` already exists and is the file described by `st` (same path, a hard link
+// or a symlink to it). Opening such an output with O_TRUNC would cut the input off under
+// the reader, and under a mapping the next access to the lost pages is a SIGBUS.
+static bool isSameFile(const std::string& path, const struct stat& st) {
+    struct stat out_st;
+    return stat(path.c_str(), &out_st) == 0 && out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino;
+}
+
+// NAL index of a mapped raw input. A sidecar from an earlier run saves the whole scan;
+// without one the file is scanned and the result saved for next time. Loading the sidecar
+// counts as demux time, a raw input has no demuxer and this takes its place.
+static std::vector<NalRef> indexElementaryStream(const MoshJob& job, const MappedFile& in, PipelineStats& stats) {
+    std::vector<NalRef> nals;
+    bool cached;
+    {
+        StageTimer timer(stats.demux);
+        cached = job.use_index && loadNalIndex(job.input_file, in.fileStat(), in.data(), in.size(), nals);
+    }
+    if (!cached) {
+        StageTimer timer(stats.scan);
+        // the scan runs in parallel chunks, the filter then walks the index in order so
+        // frame_index (and therefore every drop decision) matches a single-threaded run
+        nals = scanNalsParallel(in.data(), in.size(), job.scan_threads);
+        if (job.use_index) {
+            saveNalIndex(job.input_file, in.fileStat(), in.data(), in.size(), nals);
+        }
+        stats.scan.bytes = in.size();
+        stats.scan.nals = nals.size();
+    }
+    return nals;
+}
+
+// Raw Annex B files need no demuxing: map the file, index it in one go and writev the kept
+// spans straight out of the mapping, so the moshed stream never exists as a second copy.
+static void moshElementaryStream(const MoshJob& job, JobResult& result) {
+    MappedFile in;
+    PipelineStats& stats = result.stats;
+    bool opened;
+    {
+        StageTimer timer(stats.demux);
+        opened = in.open(job.input_file);
+    }
+    if (!opened) {
+        result.status = 2;
+        result.error = "Could not open input file: " + job.input_file;
+        return;
+    }
+    std::vector<NalRef> nals = indexElementaryStream(job, in, stats);
+    stats.demux.bytes = in.size();
+    std::vector<Span> spans;
+    size_t frame_index = 0;
+    {
+        StageTimer timer(stats.filter);
+        moshNals(nals, *job.strategy, frame_index, spans, true, job.verbose);
+    }
+    stats.filter.bytes = in.size();
+    stats.filter.nals = nals.size();
+    result.bytes_in = in.size();
+    StageTimer write_timer(stats.write);
+
+    // "-" is stdout, as it is for container outputs
+    bool to_stdout = job.output_file == "-";
+    if (!to_stdout && isSameFile(job.output_file, in.fileStat())) {
+        result.status = 6;
+        result.error = "Output file is the input file: " + job.output_file;
+        return;
+    }
+    int fd = to_stdout ? STDOUT_FILENO : open(job.output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        result.status = 6;
+        result.error = "Could not open output file: " + job.output_file;
+        return;
+    }
+    bool ok = writeSpans(fd, in.data(), spans);
+    if ((!to_stdout && close(fd) < 0) || !ok) {
+        result.status = 6;
+        result.error = "Could not write output file: " + job.output_file;
+        return;
+    }
+    for (const Span& span : spans) {
+        result.bytes_out += span.length;
+    }
+    stats.write.bytes = result.bytes_out;
+}
+
+// Latency of a live stream: time from a packet leaving av_read_frame to its moshed output
+// reaching the muxer. Printed to stderr every few seconds (stdout carries the stream).
+class LatencyMonitor {
+public:
+    using Clock = PacketQueue::Clock;
+
+    explicit LatencyMonitor(PacketQueue& queue) : queue_(queue), last_report_(Clock::now()) {}
+
+    void record(Clock::time_point read_time) {
+        Clock::time_point now = Clock::now();
+        double ms = std::chrono::duration<double, std::milli>(now - read_time).count();
+        ++packets_;
+        ++window_packets_;
+        window_sum_ms_ += ms;
+        window_max_ms_ = std::max(window_max_ms_, ms);
+        if (now - last_report_ >= std::chrono::seconds(5)) {
+            report(now);
+        }
+    }
+
+    void report(Clock::time_point now) {
+        double blocked = std::chrono::duration<double>(queue_.blockedTime()).count();
+        std::cerr << "[live] " << packets_ << " packets, latency avg " << std::fixed << std::setprecision(1)
+                  << (window_packets_ > 0 ? window_sum_ms_ / window_packets_ : 0.0) << " ms max "
+                  << window_max_ms_ << " ms, queue " << queue_.size() << "/" << queue_.capacity()
+                  << ", reader blocked " << blocked << " s" << std::endl;
+        window_packets_ = 0;
+        window_sum_ms_ = 0;
+        window_max_ms_ = 0;
+        last_report_ = now;
+    }
+
+private:
+    PacketQueue& queue_;
+    Clock::time_point last_report_;
+    size_t packets_ = 0;
+    size_t window_packets_ = 0;
+    double window_sum_ms_ = 0;
+    double window_max_ms_ = 0;
+};
+
+// Cuts the NAL index of a whole raw stream into access units, the packets the h264 demuxer
+// would have produced, so a raw input going into a container can be fed to the muxer
+// straight from its mapping. Timestamps are left unset, the muxing loop numbers them.
+static void accessUnitPackets(const std::vector<NalRef>& nals, PacketIndex& index) {
+    index.packets.clear();
+    index.nals.clear();
+    index.nals.reserve(nals.size());
+    size_t begin = 0;
+    while (begin < nals.size()) {
+        size_t end = begin;
+        bool has_picture = false;
+        bool has_idr = false;
+        for (; end < nals.size(); ++end) {
+            const NalRef& nal = nals[end];
+            if (has_picture && startsAccessUnit(nal)) {
+                break;
+            }
+            has_picture |= nal.type == 1 || nal.type == 5;
+            has_idr |= nal.type == 5;
+        }
+        PacketIndexRecord packet;
+        packet.pos = static_cast<int64_t>(nals[begin].offset);
+        packet.pts = packet.dts = AV_NOPTS_VALUE;
+        packet.duration = 0;
+        packet.size = static_cast<uint32_t>(nals[end - 1].offset + nals[end - 1].length - nals[begin].offset);
+        packet.filtered_size = packet.size;
+        packet.flags = has_idr ? AV_PKT_FLAG_KEY : 0;
+        packet.nal_count = static_cast<uint32_t>(end - begin);
+        for (size_t k = begin; k < end; ++k) {
+            NalRef nal = nals[k];
+            nal.offset -= nals[begin].offset;
+            index.nals.push_back(nal);
+        }
+        index.packets.push_back(packet);
+        begin = end;
+    }
+}
+
+// MOV/MP4 store every sample as one contiguous run of bytes at pkt->pos, so a sample can be
+// read back from the file directly. MPEG-TS spreads a payload over 188-byte packets and
+// FLV/MKV point pos at a tag or block header; those always go through the demuxer.
+static bool hasContiguousSamples(const AVFormatContext* format_context) {
+    return format_context->iformat != nullptr && format_context->iformat->name != nullptr &&
+           strstr(format_context->iformat->name, "mp4") != nullptr;
+}
+
+// "-" means stdin for inputs and stdout for outputs
+static std::string avPath(const std::string& path, bool input) {
+    if (path == "-") {
+        return input ? "pipe:0" : "pipe:1";
+    }
+    return path;
+}
+
+// Everything a container job allocates, released in one place whichever way the job ends.
+struct MuxContext {
+    // the input's interrupt callback points here, so it has to outlive avformat_close_input
+    // below (live protocols like RTSP still do I/O, and check it, while closing)
+    std::atomic<bool> abort_read{false};
+    AVFormatContext* format_context = nullptr;
+    AVFormatContext* out_format_ctx = nullptr;
+    AVBSFContext* bsf_ctx = nullptr;
+    AVPacket* pkt = nullptr;
+    AVPacket* out_pkt = nullptr;
+    AVPacket* repeat_pkt = nullptr;
+
+    ~MuxContext() {
+        if (out_format_ctx != nullptr) {
+            if (!(out_format_ctx->oformat->flags & AVFMT_NOFILE)) {
+                avio_closep(&out_format_ctx->pb);
+            }
+            avformat_free_context(out_format_ctx);
+        }
+        av_packet_free(&repeat_pkt);
+        av_packet_free(&out_pkt);
+        av_packet_free(&pkt);
+        av_bsf_free(&bsf_ctx);
+        avformat_close_input(&format_context);
+    }
+};
+
+// demux -> h264_mp4toannexb -> NAL filter -> mux, one packet at a time. Inputs whose
+// packets are already known skip the demuxer: a raw .h264 is indexed as a whole (sidecar
+// or scan) and cut into access units, an MP4/MOV with a matching packet sidecar is read back
+// sample by sample from the offsets it recorded. Both then take their NALs from the index
+// instead of scanning every packet.
+static void moshContainer(const MoshJob& job, JobResult& result) {
+    MuxContext ctx;
+    std::string input_path = avPath(job.input_file, true);
+    std::string output_path = avPath(job.output_file, false);
+    const char* input_file = input_path.c_str();
+    const char* output_file = output_path.c_str();
+    auto fail = [&](int status, const std::string& error) {
+        result.status = status;
+        result.error = error;
+    };
+
+    // lets a failed write unblock a reader that is waiting on a live input
+    ctx.format_context = avformat_alloc_context();
+    ctx.format_context->interrupt_callback.callback = [](void* opaque) {
+        return static_cast<std::atomic<bool>*>(opaque)->load() ? 1 : 0;
+    };
+    ctx.format_context->interrupt_callback.opaque = &ctx.abort_read;
+
+    // open the input file and allocate the format context
+    if (avformat_open_input(&ctx.format_context, input_file, nullptr, nullptr ) < 0) {
+        return fail(2, "Could not open input file: " + job.input_file);
+    }
+    if (avformat_find_stream_info(ctx.format_context, nullptr) < 0) {
+        return fail(3, "Could not find stream information: " + job.input_file);
+    }
+    //here we find the video stream
+    int HEVC_index = -1;
+    for (unsigned int i = 0; i < ctx.format_context->nb_streams; ++i) {
+        if (ctx.format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            ctx.format_context->streams[i]->codecpar->codec_id == AV_CODEC_ID_H264) {
+            HEVC_index = i;
+            break;
+        }
+    }
+
+    if (HEVC_index == -1) {
+        return fail(4, "Could not find H264 stream: " + job.input_file);
+    }
+    AVCodecParameters* in_codecpar = ctx.format_context->streams[HEVC_index]->codecpar;
+    AVRational time_base = ctx.format_context->streams[HEVC_index]->time_base;
+
+    // MP4/MKV carry length-prefixed NALs; h264_mp4toannexb rewrites them with start codes
+    // (and injects SPS/PPS before IDRs) so every packet can be scanned on its own.
+    // It passes streams that are already Annex B through untouched.
+    if (av_bsf_alloc(av_bsf_get_by_name("h264_mp4toannexb"), &ctx.bsf_ctx) < 0 ||
+        avcodec_parameters_copy(ctx.bsf_ctx->par_in, in_codecpar) < 0) {
+        return fail(5, "Could not create h264_mp4toannexb filter");
+    }
+    ctx.bsf_ctx->time_base_in = time_base;
+    if (av_bsf_init(ctx.bsf_ctx) < 0) {
+        return fail(5, "Could not initialise h264_mp4toannexb filter");
+    }
+
+    struct stat in_st;
+    if (job.input_file != "-" && job.output_file != "-" && stat(job.input_file.c_str(), &in_st) == 0 &&
+        isSameFile(job.output_file, in_st)) {
+        return fail(6, "Output file is the input file: " + job.output_file);
+    }
+    const char* format_name = job.output_format.empty() ? nullptr : job.output_format.c_str();
+    if (avformat_alloc_output_context2(&ctx.out_format_ctx, nullptr, format_name, output_file) < 0) {
+        return fail(6, "Could not create output context for: " + job.output_file);
+    }
+    AVStream* out_stream = avformat_new_stream(ctx.out_format_ctx, nullptr);
+    // par_out carries the Annex B SPS/PPS, the muxer converts back to avcC for MP4 itself
+    avcodec_parameters_copy(out_stream->codecpar, ctx.bsf_ctx->par_out);
+    out_stream->codecpar->codec_tag = 0;
+    out_stream->time_base = time_base;
+
+    if (!(ctx.out_format_ctx->oformat->flags & AVFMT_NOFILE) &&
+        avio_open(&ctx.out_format_ctx->pb, output_file, AVIO_FLAG_WRITE) < 0) {
+        return fail(6, "Could not open output file: " + job.output_file);
+    }
+    AVDictionary* mux_options = nullptr;
+    if (job.live) {
+        // hand every packet to the output as soon as it is muxed instead of batching writes
+        ctx.out_format_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        // plain MP4 needs a seekable output for its index, fragmented MP4 streams
+        av_dict_set(&mux_options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    PipelineStats& stats = result.stats;
+    int header_ret;
+    {
+        StageTimer timer(stats.mux);
+        header_ret = avformat_write_header(ctx.out_format_ctx, &mux_options);
+    }
+    av_dict_free(&mux_options);
+    if (header_ret < 0) {
+        return fail(6, "Could not write header for: " + job.output_file);
+    }
+
+    // kept NALs go straight from each packet to the muxer, nothing is buffered between packets
+    ctx.pkt = av_packet_alloc();
+    ctx.out_pkt = av_packet_alloc();
+    ctx.repeat_pkt = av_packet_alloc();
+    AVPacket* pkt = ctx.pkt;
+    AVPacket* out_pkt = ctx.out_pkt;
+    AVPacket* repeat_pkt = ctx.repeat_pkt;
+    std::vector<Span> spans;
+    size_t frame_index = 0;
+    // how far repeated packets have pushed everything after them, in time_base_out units
+    int64_t ts_shift = 0;
+    AVRational frame_rate = ctx.format_context->streams[HEVC_index]->avg_frame_rate;
+    int64_t default_duration = frame_rate.num > 0 && frame_rate.den > 0
+        ? av_rescale_q(1, AVRational{frame_rate.den, frame_rate.num}, ctx.bsf_ctx->time_base_out)
+        : 1;
+
+    // raw .h264 inputs come out of the demuxer with few or no timestamps; number those
+    // packets one frame apart so the muxer still gets a monotonic dts
+    int64_t next_dts = 0;
+    int write_error = 0;
+    auto writePacket = [&](int64_t shift) {
+        if (out_pkt->pts != AV_NOPTS_VALUE) {
+            out_pkt->pts += shift;
+        }
+        if (out_pkt->dts != AV_NOPTS_VALUE) {
+            out_pkt->dts += shift;
+        }
+        out_pkt->stream_index = out_stream->index;
+        av_packet_rescale_ts(out_pkt, ctx.bsf_ctx->time_base_out, out_stream->time_base);
+        result.bytes_out += out_pkt->size;
+        stats.mux.bytes += out_pkt->size;
+        StageTimer timer(stats.mux);
+        int ret = av_interleaved_write_frame(ctx.out_format_ctx, out_pkt);
+        if (ret < 0 && write_error == 0) {
+            write_error = ret;
+        }
+        av_packet_unref(out_pkt);
+    };
+
+    // packets whose samples can be read back on the next run; the cache is only written
+    // once the whole input went through the filter one packet in, one packet out
+    MappedFile in;
+    PacketIndex cache;
+    bool replay = false;
+    bool recording = false;
+    std::deque<PacketIndexRecord> pending;
+    if (!job.live && job.input_file != "-") {
+        bool raw_input = isElementaryStream(job.input_file);
+        bool indexable = raw_input || (job.use_index && hasContiguousSamples(ctx.format_context));
+        bool mapped = false;
+        if (indexable) {
+            StageTimer timer(stats.demux);
+            mapped = in.open(job.input_file);
+        }
+        if (mapped && raw_input) {
+            accessUnitPackets(indexElementaryStream(job, in, stats), cache);
+            replay = true;
+        } else if (mapped) {
+            StageTimer timer(stats.demux);
+            replay = loadPacketIndex(job.input_file, in.fileStat(), in.data(), in.size(), cache) &&
+                     cache.stream_index == HEVC_index && cache.time_base_num == time_base.num &&
+                     cache.time_base_den == time_base.den;
+            recording = !replay;
+            if (recording) {
+                cache = PacketIndex();
+            }
+            cache.stream_index = HEVC_index;
+            cache.time_base_num = time_base.num;
+            cache.time_base_den = time_base.den;
+        }
+    }
+
+    // `expected`, when given, is the index entry of the packet just sent to the filter: its
+    // NALs are used instead of a scan as long as the filtered packet has the recorded size
+    auto drainFilter = [&](const PacketIndexRecord* expected, const NalRef* expected_nals) {
+        while (av_bsf_receive_packet(ctx.bsf_ctx, pkt) == 0) {
+            std::vector<NalRef> nals;
+            if (expected != nullptr && static_cast<uint32_t>(pkt->size) == expected->filtered_size) {
+                nals.assign(expected_nals, expected_nals + expected->nal_count);
+            } else {
+                {
+                    StageTimer timer(stats.scan);
+                    nals = scanNals(pkt->data, pkt->size);
+                }
+                stats.scan.bytes += pkt->size;
+                stats.scan.nals += nals.size();
+            }
+            expected = nullptr;
+            if (recording) {
+                if (pending.empty()) {
+                    recording = false;
+                } else {
+                    PacketIndexRecord record = pending.front();
+                    pending.pop_front();
+                    record.filtered_size = static_cast<uint32_t>(pkt->size);
+                    record.nal_count = static_cast<uint32_t>(nals.size());
+                    cache.packets.push_back(record);
+                    cache.nals.insert(cache.nals.end(), nals.begin(), nals.end());
+                }
+            }
+            stats.filter.bytes += pkt->size;
+            stats.filter.nals += nals.size();
+
+            spans.clear();
+            MoshOutcome outcome;
+            int built;
+            {
+                StageTimer timer(stats.filter);
+                outcome = moshNals(nals, *job.strategy, frame_index, spans, false, job.verbose);
+                built = spans.empty() ? -1 : buildPacket(pkt, spans, repeat_pkt);
+            }
+            if (built == 0) {
+                // original pts/dts/duration, rescaled to whatever time_base the muxer picked
+                if (outcome.dropped_idr) {
+                    repeat_pkt->flags &= ~AV_PKT_FLAG_KEY;
+                }
+                int64_t duration = repeat_pkt->duration > 0 ? repeat_pkt->duration : default_duration;
+                if (repeat_pkt->pts == AV_NOPTS_VALUE && repeat_pkt->dts == AV_NOPTS_VALUE) {
+                    repeat_pkt->pts = repeat_pkt->dts = next_dts;
+                }
+                next_dts = (repeat_pkt->dts != AV_NOPTS_VALUE ? repeat_pkt->dts : repeat_pkt->pts) + duration;
+                // a repeated frame goes out as further references to the same buffer, each one
+                // frame later, and everything after it moves back by the time it took up
+                for (unsigned k = 0; k < outcome.frame_repeat; ++k) {
+                    if (av_packet_ref(out_pkt, repeat_pkt) < 0) {
+                        break;
+                    }
+                    if (k > 0) {
+                        out_pkt->flags &= ~AV_PKT_FLAG_KEY;
+                    }
+                    writePacket(ts_shift + duration * k);
+                }
+                ts_shift += duration * (outcome.frame_repeat - 1);
+                av_packet_unref(repeat_pkt);
+            }
+            av_packet_unref(pkt);
+        }
+    };
+
+    auto readPacket = [&](AVPacket* into) {
+        StageTimer timer(stats.demux);
+        if (av_read_frame(ctx.format_context, into) < 0) {
+            return false;
+        }
+        if (into->stream_index == HEVC_index) {
+            stats.demux.bytes += into->size;
+        }
+        return true;
+    };
+
+    auto moshPacket = [&]() {
+        result.bytes_in += pkt->size;
+        // only samples that are exactly the file's bytes at pkt->pos can be read back later
+        if (recording) {
+            if (pkt->pos < 0 || static_cast<uint64_t>(pkt->pos) + pkt->size > in.size() ||
+                memcmp(in.data() + pkt->pos, pkt->data, pkt->size) != 0) {
+                recording = false;
+            } else {
+                pending.push_back({pkt->pos, pkt->pts, pkt->dts, pkt->duration, static_cast<uint32_t>(pkt->size), 0,
+                                   static_cast<uint32_t>(pkt->flags), 0});
+            }
+        }
+        // the filter takes ownership of the packet's reference
+        if (av_bsf_send_packet(ctx.bsf_ctx, pkt) < 0) {
+            av_packet_unref(pkt);
+        }
+        drainFilter(nullptr, nullptr);
+    };
+
+    // the sample is copied out of the mapping into a padded packet, the one read it gets
+    auto replayPacket = [&](const PacketIndexRecord& record, const NalRef* nals) {
+        {
+            StageTimer timer(stats.demux);
+            if (av_new_packet(pkt, static_cast<int>(record.size)) < 0) {
+                return;
+            }
+            memcpy(pkt->data, in.data() + record.pos, record.size);
+        }
+        pkt->pts = record.pts;
+        pkt->dts = record.dts;
+        pkt->duration = record.duration;
+        pkt->flags = static_cast<int>(record.flags);
+        pkt->pos = record.pos;
+        pkt->stream_index = HEVC_index;
+        result.bytes_in += record.size;
+        stats.demux.bytes += record.size;
+        if (av_bsf_send_packet(ctx.bsf_ctx, pkt) < 0) {
+            av_packet_unref(pkt);
+        }
+        drainFilter(&record, nals);
+    };
+
+    if (job.live) {
+        // a reader thread keeps pulling from the input while this one moshes and muxes; the
+        // ring between them is the only buffering, so memory stays flat on endless streams
+        PacketQueue queue(job.queue_packets);
+        LatencyMonitor latency(queue);
+        std::thread reader([&]() {
+            // only this thread touches stats.demux until it is joined
+            AVPacket* read_pkt = av_packet_alloc();
+            while (read_pkt != nullptr && readPacket(read_pkt)) {
+                if (read_pkt->stream_index != HEVC_index) {
+                    av_packet_unref(read_pkt);
+                } else if (!queue.push(read_pkt)) {
+                    break;
+                }
+            }
+            av_packet_free(&read_pkt);
+            queue.close();
+        });
+
+        PacketQueue::Clock::time_point read_time;
+        while (write_error == 0 && queue.pop(pkt, read_time)) {
+            moshPacket();
+            latency.record(read_time);
+        }
+        // the consumer gave up (output closed): stop the reader even if it is blocked
+        ctx.abort_read = true;
+        queue.close();
+        reader.join();
+        latency.report(PacketQueue::Clock::now());
+    } else if (replay) {
+        size_t next_nal = 0;
+        for (const PacketIndexRecord& record : cache.packets) {
+            if (write_error != 0) {
+                break;
+            }
+            replayPacket(record, cache.nals.data() + next_nal);
+            next_nal += record.nal_count;
+        }
+    } else {
+        while (write_error == 0 && readPacket(pkt)) {
+            if (pkt->stream_index == HEVC_index) {
+                moshPacket();
+            } else {
+                av_packet_unref(pkt);
+            }
+        }
+    }
+    if (write_error != 0) {
+        return fail(8, "Could not write to output: " + job.output_file);
+    }
+    // flush whatever the filter is still holding
+    av_bsf_send_packet(ctx.bsf_ctx, nullptr);
+    drainFilter(nullptr, nullptr);
+
+    {
+        StageTimer timer(stats.mux);
+        if (av_write_trailer(ctx.out_format_ctx) < 0) {
+            return fail(6, "Could not write trailer for: " + job.output_file);
+        }
+    }
+    if (recording && pending.empty()) {
+        savePacketIndex(job.input_file, in.fileStat(), in.data(), in.size(), cache);
+    }
+}
+
+bool isElementaryStream(const std::string& path) {
+    for (const char* ext : {".h264", ".264"}) {
+        size_t len = strlen(ext);
+        if (path.size() > len && path.compare(path.size() - len, len, ext) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+JobResult moshFile(const MoshJob& job) {
+    JobResult result;
+    auto start = std::chrono::steady_clock::now();
+    // the mmap/writev path only applies when both ends are raw Annex B; a raw input going
+    // into a container still has to be muxed
+    bool raw_output = job.output_format.empty() ? isElementaryStream(job.output_file)
+                                                : job.output_format == "h264";
+    if (!job.live && isElementaryStream(job.input_file) && raw_output) {
+        moshElementaryStream(job, result);
+    } else {
+        moshContainer(job, result);
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// Runs every job on a fixed pool of `threads` workers. Workers pull the next job index off
+// a shared counter, so a slow clip never holds up the rest of the queue.
+std::vector<JobResult> runJobs(const std::vector<MoshJob>& jobs, unsigned threads) {
+    std::vector<JobResult> results(jobs.size());
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t k = next++; k < jobs.size(); k = next++) {
+            results[k] = moshFile(jobs[k]);
+        }
+    };
+
+    if (threads > jobs.size()) {
+        threads = static_cast<unsigned>(jobs.size());
+    }
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    return results;
+}
+
+// <dir>/<stem>_moshed.<ext>, next to the input unless an output directory was given
+std::string outputPathFor(const std::string& input_file, const std::string& output_dir) {
+    size_t slash = input_file.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "" : input_file.substr(0, slash + 1);
+    std::string name = slash == std::string::npos ? input_file : input_file.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    std::string stem = dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+    if (!output_dir.empty()) {
+        dir = output_dir.back() == '/' ? output_dir : output_dir + "/";
+    }
+    return dir + stem + "_moshed" + (isElementaryStream(input_file) ? ".h264" : ".mp4");
+}
+
+// Stems alone are not unique in a batch: a/clip.mp4 and b/clip.mp4 under -d, clip.mp4 and
+// clip.mov, or the same manifest line twice would all write one file at the same time. Give
+// every output after the first a _2, _3, ... suffix, skipping names already taken by another
+// output or by one of the inputs.
+void makeOutputPathsUnique(std::vector<MoshJob>& jobs) {
+    std::set<std::string> taken;
+    for (const MoshJob& job : jobs) {
+        taken.insert(job.input_file);
+    }
+    std::set<std::string> outputs;
+    for (MoshJob& job : jobs) {
+        if (outputs.count(job.output_file) == 0 && taken.count(job.output_file) == 0) {
+            outputs.insert(job.output_file);
+            continue;
+        }
+        size_t slash = job.output_file.find_last_of('/');
+        size_t dot = job.output_file.find_last_of('.');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            dot = job.output_file.size();
+        }
+        std::string base = job.output_file.substr(0, dot);
+        std::string ext = job.output_file.substr(dot);
+        std::string candidate;
+        for (int n = 2;; ++n) {
+            candidate = base + "_" + std::to_string(n) + ext;
+            if (outputs.count(candidate) == 0 && taken.count(candidate) == 0) {
+                break;
+            }
+        }
+        job.output_file = candidate;
+        outputs.insert(candidate);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include "moshStats.h"
+#include "moshUtil.h"
+
+// One input/output pair. Each job opens and owns its own AVFormatContexts, so jobs can run
+// on any worker thread without sharing libav state.
+struct MoshJob {
+    std::string input_file;
+    std::string output_file;
+    bool verbose = true;
+    unsigned scan_threads = 1; // threads used to scan a raw .h264 input
+    bool use_index = true;     // read/write the <input>.nalidx sidecar for raw inputs
+    std::shared_ptr<const MoshStrategy> strategy;
+    bool live = false;          // pipe/live input: reader thread, bounded ring, flushed output
+    std::string output_format;  // muxer name, empty to guess it from output_file
+    size_t queue_packets = 32;  // ring size between reader and muxer in live mode
+};
+
+struct JobResult {
+    int status = 0;       // 0 on success, otherwise the exit code main() used to return
+    std::string error;
+    size_t bytes_in = 0;  // video bytes read from the input
+    size_t bytes_out = 0; // video bytes handed to the output
+    double seconds = 0;
+    PipelineStats stats;
+};
+
+// True for raw Annex B file names (.h264/.264)
+bool isElementaryStream(const std::string& path);
+
+// Runs one job start to finish: raw .h264 -> raw .h264 through mmap/writev, everything else
+// through demux -> h264_mp4toannexb -> NAL filter -> mux.
+JobResult moshFile(const MoshJob& job);
+
+// Runs every job on a fixed pool of `threads` workers, results in job order.
+std::vector<JobResult> runJobs(const std::vector<MoshJob>& jobs, unsigned threads);
+
+// Default output path for an input, optionally placed under output_dir
+std::string outputPathFor(const std::string& input_file, const std::string& output_dir);
+
+// Renames colliding outputs of a batch with _2, _3, ... suffixes.
+void makeOutputPathsUnique(std::vector<MoshJob>& jobs);
@@ -0,0 +1,82 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+#include <sys/resource.h>
+
+// Wall time and throughput of one pipeline stage, summed over every call.
+struct StageStats {
+    std::chrono::steady_clock::duration time{0};
+    size_t bytes = 0;
+    size_t nals = 0;
+
+    void add(const StageStats& other) {
+        time += other.time;
+        bytes += other.bytes;
+        nals += other.nals;
+    }
+};
+
+// demux -> scan -> filter -> write (raw outputs) / mux (container outputs)
+struct PipelineStats {
+    StageStats demux;
+    StageStats scan;
+    StageStats filter;
+    StageStats write;
+    StageStats mux;
+
+    void add(const PipelineStats& other) {
+        demux.add(other.demux);
+        scan.add(other.scan);
+        filter.add(other.filter);
+        write.add(other.write);
+        mux.add(other.mux);
+    }
+};
+
+// Adds the lifetime of the scope to a stage. steady_clock::now() is a vDSO call, cheap
+// enough to wrap per-packet work.
+class StageTimer {
+public:
+    explicit StageTimer(StageStats& stage) : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+    ~StageTimer() { stage_.time += std::chrono::steady_clock::now() - start_; }
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    StageStats& stage_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Peak resident set size of the process so far, in bytes (ru_maxrss is KiB on Linux)
+inline size_t peakRssBytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+}
+
+inline void printStageStats(std::ostream& out, const char* name, const StageStats& stage) {
+    double seconds = std::chrono::duration<double>(stage.time).count();
+    if (seconds <= 0 && stage.bytes == 0 && stage.nals == 0) {
+        return;
+    }
+    double mib = stage.bytes / (1024.0 * 1024.0);
+    out << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(3)
+        << std::setw(10) << seconds << " s" << std::setprecision(1) << std::setw(12)
+        << (seconds > 0 ? mib / seconds : 0.0) << " MiB/s" << std::setprecision(0) << std::setw(14)
+        << (seconds > 0 ? stage.nals / seconds : 0.0) << " NALs/s\n";
+}
+
+inline void printPipelineStats(std::ostream& out, const PipelineStats& stats) {
+    out << "stage         wall       throughput           NAL rate\n";
+    printStageStats(out, "demux", stats.demux);
+    printStageStats(out, "scan", stats.scan);
+    printStageStats(out, "filter", stats.filter);
+    printStageStats(out, "write", stats.write);
+    printStageStats(out, "mux", stats.mux);
+    out << "peak RSS " << std::fixed << std::setprecision(1) << peakRssBytes() / (1024.0 * 1024.0)
+        << " MiB" << std::endl;
+}
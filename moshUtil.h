@@ -1,4 +1,166 @@
 #pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "nalScanner.h"
+#include "spanWriter.h"
+
 enum MoshType {
     IFRAMERM = 0,
-};
\ No newline at end of file
+    PFRAMEDUP = 1,
+};
+
+// Inclusive range of frame indices a strategy applies to
+struct FrameRange {
+    size_t first;
+    size_t last;
+
+    bool contains(size_t frame_index) const {
+        return frame_index >= first && frame_index <= last;
+    }
+};
+
+inline bool inRanges(const std::vector<FrameRange>& ranges, size_t frame_index) {
+    for (const FrameRange& range : ranges) {
+        if (range.contains(frame_index)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decides what happens to each frame NAL (1 = P/B, 5 = IDR/I-frame). Parameter sets, SEI
+// and AUDs are always kept and never reach the strategy. Strategies hold no per-stream
+// state, so one instance can be shared by every job of a batch.
+class MoshStrategy {
+public:
+    virtual ~MoshStrategy() = default;
+
+    // How many times the NAL is emitted: 0 drops it, 1 keeps it, more repeats it. Repeats
+    // are written as extra references to the same source bytes, never as copies.
+    virtual unsigned repeatCount(const NalRef& nal, size_t frame_index) const = 0;
+};
+
+// Drops the IDR frames inside the ranges so the following P-frames smear over whatever
+// picture came before. Frame 0 is always kept, the decoder needs something to start from.
+class IFrameRemoval : public MoshStrategy {
+public:
+    explicit IFrameRemoval(std::vector<FrameRange> ranges) : ranges_(std::move(ranges)) {}
+
+    unsigned repeatCount(const NalRef& nal, size_t frame_index) const override {
+        if (nal.type == 5 && frame_index != 0 && inRanges(ranges_, frame_index)) {
+            return 0;
+        }
+        return 1;
+    }
+
+private:
+    std::vector<FrameRange> ranges_;
+};
+
+// Repeats every P/B frame inside the ranges `repeat` times, so its motion vectors are
+// applied over and over ("bloom").
+class PFrameDuplication : public MoshStrategy {
+public:
+    PFrameDuplication(std::vector<FrameRange> ranges, unsigned repeat)
+        : ranges_(std::move(ranges)), repeat_(repeat) {}
+
+    unsigned repeatCount(const NalRef& nal, size_t frame_index) const override {
+        if (nal.type == 1 && inRanges(ranges_, frame_index)) {
+            return repeat_;
+        }
+        return 1;
+    }
+
+private:
+    std::vector<FrameRange> ranges_;
+    unsigned repeat_;
+};
+
+inline std::shared_ptr<const MoshStrategy> makeMoshStrategy(MoshType type, std::vector<FrameRange> ranges,
+                                                            unsigned repeat) {
+    switch (type) {
+    case PFRAMEDUP:
+        return std::make_shared<PFrameDuplication>(std::move(ranges), repeat);
+    case IFRAMERM:
+    default:
+        return std::make_shared<IFrameRemoval>(std::move(ranges));
+    }
+}
+
+// What moshNals did to one buffer, for callers that need to fix up packet metadata
+struct MoshOutcome {
+    bool dropped_idr = false;
+    unsigned frame_repeat = 1; // largest repeat count any frame NAL asked for
+};
+
+// Runs `strategy` over an indexed Annex B buffer and appends the kept NALs to `out` as spans
+// of that buffer. frame_index counts pictures and carries over between calls, so this works
+// per packet as well as over a whole file. With inline_repeats (raw streams) a repeated
+// picture's whole access unit is appended that many times as one block, the way the
+// container path repeats a whole packet; repeating slice by slice would give s0 s0 s1 s1,
+// which a decoder reads as partial pictures and duplicate slices. Without inline_repeats
+// each NAL appears once and the caller repeats the packet.
+inline MoshOutcome moshNals(const std::vector<NalRef>& nals, const MoshStrategy& strategy,
+                     size_t& frame_index, std::vector<Span>& out, bool inline_repeats, bool verbose) {
+    MoshOutcome outcome;
+    // the access unit being collected when repeats are inlined, written out once it is complete
+    std::vector<Span> unit;
+    unsigned unit_repeat = 1;
+    bool unit_has_picture = false;
+    std::vector<Span>& dest = inline_repeats ? unit : out;
+    // one log line per picture, not one per slice
+    size_t logged_frame = SIZE_MAX;
+    auto flushUnit = [&]() {
+        // the same spans again each time, the bytes themselves are never copied
+        for (unsigned k = 0; k < unit_repeat; ++k) {
+            for (const Span& span : unit) {
+                appendSpan(out, span.offset, span.length);
+            }
+        }
+        unit.clear();
+        unit_repeat = 1;
+        unit_has_picture = false;
+    };
+
+    for (const NalRef& nal : nals) {
+        if (inline_repeats && unit_has_picture && startsAccessUnit(nal)) {
+            flushUnit();
+        }
+        // keep these  NAL types: SPS (7), PPS (8), SEI (6), AUD (9)
+        if (nal.type == 6 || nal.type == 7 || nal.type == 8 || nal.type == 9) {
+            appendSpan(dest, nal.offset, nal.length);
+        }
+        // Handle frame NALs (1 = P/B, 5 = IDR/I-frame)
+        else if (nal.type == 1 || nal.type == 5) {
+            size_t frame = nextFrameNumber(nal, frame_index);
+            unsigned repeat = strategy.repeatCount(nal, frame);
+            unit_has_picture = true;
+            bool log = verbose && frame != logged_frame;
+            logged_frame = frame;
+
+            if (repeat == 0) {
+                if (log) {
+                    std::cout << "Skipping " << (nal.type == 5 ? "IDR" : "P") << " frame at frame_index: "
+                              << frame << '\n';
+                }
+                outcome.dropped_idr |= nal.type == 5;
+            } else {
+                if (repeat > 1 && log) {
+                    std::cout << "Repeating frame at frame_index: " << frame << " x" << repeat << '\n';
+                }
+                appendSpan(dest, nal.offset, nal.length);
+                unit_repeat = std::max(unit_repeat, repeat);
+                outcome.frame_repeat = std::max(outcome.frame_repeat, repeat);
+            }
+        }
+    }
+    if (inline_repeats) {
+        flushUnit();
+    }
+    return outcome;
+}
@@ -0,0 +1,108 @@
+// moshNals on a raw stream with two-slice pictures: a repeated picture has to come out as
+// whole access units (s0 s1 s0 s1 ...), a dropped IDR has to lose both of its slices, and
+// the frame numbers (and therefore the ranges) have to count pictures, not slices.
+#include <cstdio>
+#include <vector>
+#include "moshUtil.h"
+#include "nalScanner.h"
+#include "spanWriter.h"
+
+typedef std::vector<uint8_t> Bytes;
+
+// One NAL with a 4-byte start code. For slices the byte after the header starts the slice
+// header: 0x88 is first_mb_in_slice 0 (ue "1"), 0x60 is first_mb_in_slice 2 (ue "011").
+static Bytes nal(uint8_t header, uint8_t first_byte, uint8_t tag) {
+    return {0x00, 0x00, 0x00, 0x01, header, first_byte, 0x84, tag, 0x42};
+}
+
+static Bytes concat(const std::vector<Bytes>& parts) {
+    Bytes out;
+    for (const Bytes& part : parts) {
+        out.insert(out.end(), part.begin(), part.end());
+    }
+    return out;
+}
+
+static Bytes applySpans(const Bytes& stream, const std::vector<Span>& spans) {
+    Bytes out;
+    for (const Span& span : spans) {
+        out.insert(out.end(), stream.begin() + span.offset, stream.begin() + span.offset + span.length);
+    }
+    return out;
+}
+
+static int check(const char* name, const Bytes& actual, const Bytes& expected) {
+    if (actual == expected) {
+        return 0;
+    }
+    printf("FAIL %s: got %zu bytes, expected %zu\n", name, actual.size(), expected.size());
+    return 1;
+}
+
+int main() {
+    const Bytes sps = nal(0x67, 0x42, 0), pps = nal(0x68, 0xCE, 0);
+    // picture n is slices s<n>a (first_mb 0) and s<n>b; pictures 0 and 2 are IDRs
+    std::vector<Bytes> a, b;
+    for (uint8_t n = 0; n < 4; ++n) {
+        uint8_t header = n == 0 || n == 2 ? 0x65 : 0x41;
+        a.push_back(nal(header, 0x88, static_cast<uint8_t>(0x10 + n)));
+        b.push_back(nal(header, 0x60, static_cast<uint8_t>(0x20 + n)));
+    }
+    const Bytes stream = concat({sps, pps, a[0], b[0], a[1], b[1], pps, a[2], b[2], a[3], b[3]});
+    std::vector<NalRef> nals = scanNals(stream.data(), stream.size());
+    int failures = 0;
+
+    if (nals.size() != 11 || !nals[2].first_slice || nals[3].first_slice || nals[0].first_slice) {
+        printf("FAIL scan: first_slice flags are wrong\n");
+        ++failures;
+    }
+
+    // picture 1 three times, each time both of its slices in order
+    {
+        std::vector<Span> spans;
+        size_t frame_index = 0;
+        moshNals(nals, *makeMoshStrategy(PFRAMEDUP, {{1, 1}}, 3), frame_index, spans, true, false);
+        failures += check("repeat two-slice picture", applySpans(stream, spans),
+                          concat({sps, pps, a[0], b[0], a[1], b[1], a[1], b[1], a[1], b[1], pps, a[2], b[2],
+                                  a[3], b[3]}));
+        if (frame_index != 4) {
+            printf("FAIL frame_index counted %zu pictures, expected 4\n", frame_index);
+            ++failures;
+        }
+    }
+
+    // frame 2 is the second IDR: both slices go, the PPS in front of it stays
+    {
+        std::vector<Span> spans;
+        size_t frame_index = 0;
+        moshNals(nals, *makeMoshStrategy(IFRAMERM, {{2, 2}}, 1), frame_index, spans, true, false);
+        failures += check("drop two-slice IDR", applySpans(stream, spans),
+                          concat({sps, pps, a[0], b[0], a[1], b[1], pps, a[3], b[3]}));
+    }
+
+    // per-packet use (the container path): one access unit per call, repeats left to the caller
+    {
+        size_t frame_index = 0;
+        unsigned repeat = 0;
+        auto strategy = makeMoshStrategy(PFRAMEDUP, {{1, 1}}, 3);
+        // NAL index ranges of the four access units
+        const size_t bounds[] = {0, 4, 6, 9, 11};
+        for (size_t k = 0; k < 4; ++k) {
+            std::vector<NalRef> packet(nals.begin() + bounds[k], nals.begin() + bounds[k + 1]);
+            std::vector<Span> spans;
+            MoshOutcome outcome = moshNals(packet, *strategy, frame_index, spans, false, false);
+            if (k == 1) {
+                repeat = outcome.frame_repeat;
+            }
+        }
+        if (repeat != 3 || frame_index != 4) {
+            printf("FAIL per-packet: repeat %u, frame_index %zu\n", repeat, frame_index);
+            ++failures;
+        }
+    }
+
+    if (failures == 0) {
+        printf("access units are repeated and dropped whole\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,300 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "nalScanner.h"
+
+// Sidecar cache of an input's NAL index, stored next to it as <input>.nalidx. Re-moshing
+// the same source with different settings then skips the scan entirely.
+//
+// Raw .h264 inputs store the NALs of the whole file: the kept spans are written (or muxed)
+// straight out of the mapping and only those pages are ever read.
+//
+// MP4/MOV inputs store one record per video packet after h264_mp4toannexb: where the sample
+// lies in the file, its timestamps and flags, and the NALs of the filtered packet. A rerun
+// reads just those samples back from their offsets, without demuxing the container or
+// touching the other streams, and takes the NALs from the cache instead of scanning.
+//
+// Layout (host byte order, it is a local cache and not an interchange format):
+//   NalIndexHeader                   PacketIndexHeader
+//   count x NalIndexRecord           count x PacketIndexRecord
+//                                    nal_count x NalIndexRecord
+// The cache is only used when size, mtime and the sampled content hash all still match.
+
+static const char kNalIndexMagic[8] = {'M', 'O', 'S', 'H', 'I', 'D', 'X', '2'};
+static const char kPacketIndexMagic[8] = {'M', 'O', 'S', 'H', 'P', 'K', 'T', '1'};
+
+struct NalIndexHeader {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t content_hash;
+    uint64_t count;
+};
+
+// 16 bytes per NAL; the type lives in the low 5 bits of frame_type, first_slice in bit 5,
+// the frame number (the value frame_index had when the NAL was reached) in the rest
+struct NalIndexRecord {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t frame_type;
+};
+
+// One video packet of a container input. pos/size locate the sample in the file,
+// filtered_size is the packet h264_mp4toannexb made of it, which its nal_count NAL records
+// (offsets relative to the filtered packet) describe.
+struct PacketIndexRecord {
+    int64_t pos;
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    uint32_t size;
+    uint32_t filtered_size;
+    uint32_t flags;
+    uint32_t nal_count;
+};
+
+struct PacketIndexHeader {
+    NalIndexHeader file; // magic kPacketIndexMagic, count = number of packets
+    int32_t stream_index;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    uint32_t reserved;
+    uint64_t nal_count;
+};
+
+// A container input's cached packets; packet k owns the next packets[k].nal_count entries
+// of nals
+struct PacketIndex {
+    int stream_index = -1;
+    int time_base_num = 0;
+    int time_base_den = 0;
+    std::vector<PacketIndexRecord> packets;
+    std::vector<NalRef> nals;
+};
+
+inline std::string nalIndexPath(const std::string& input_file) {
+    return input_file + ".nalidx";
+}
+
+// FNV-1a over the first and last 64 KiB plus 64 KiB at 14 evenly spaced points. Hashing
+// the whole file would cost the very read the cache exists to avoid; together with size and
+// mtime this still catches files that were re-encoded or edited in place.
+inline uint64_t sampledContentHash(const uint8_t* data, size_t size) {
+    const size_t block = 64 * 1024;
+    const int samples = 16;
+    uint64_t hash = 1469598103934665603ULL;
+    auto mix = [&](size_t begin) {
+        size_t end = begin + block < size ? begin + block : size;
+        for (size_t i = begin; i < end; ++i) {
+            hash = (hash ^ data[i]) * 1099511628211ULL;
+        }
+    };
+    if (size <= block * samples) {
+        mix(0);
+        for (size_t i = block; i < size; i += block) {
+            mix(i);
+        }
+        return hash;
+    }
+    for (int k = 0; k < samples; ++k) {
+        mix((size - block) / (samples - 1) * k);
+    }
+    return hash;
+}
+
+inline NalIndexHeader makeNalIndexHeader(const struct stat& st, const uint8_t* data, size_t size,
+                                         const char* magic = kNalIndexMagic) {
+    NalIndexHeader header;
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.file_size = size;
+    header.mtime_sec = st.st_mtim.tv_sec;
+    header.mtime_nsec = st.st_mtim.tv_nsec;
+    header.content_hash = sampledContentHash(data, size);
+    header.count = 0;
+    return header;
+}
+
+// Checks a sidecar header against the mapped input, the cheap fields before hashing anything
+inline bool nalIndexHeaderMatches(const NalIndexHeader& header, const char* magic, const struct stat& st,
+                                  const uint8_t* data, size_t size) {
+    return memcmp(header.magic, magic, sizeof(header.magic)) == 0 && header.file_size == size &&
+           header.mtime_sec == st.st_mtim.tv_sec && header.mtime_nsec == st.st_mtim.tv_nsec &&
+           header.content_hash == sampledContentHash(data, size);
+}
+
+// Bytes in the sidecar after a header of `header_size`, so a truncated or corrupt one can't
+// ask for more records than it holds
+inline size_t sidecarPayloadSize(FILE* f, size_t header_size) {
+    struct stat sidecar_st;
+    if (fstat(fileno(f), &sidecar_st) != 0 || static_cast<size_t>(sidecar_st.st_size) < header_size) {
+        return 0;
+    }
+    return static_cast<size_t>(sidecar_st.st_size) - header_size;
+}
+
+// Turns stored records back into NalRefs that must fit in `limit` bytes. The stored frame
+// numbers must be exactly what moshNals will count as frame_index while walking them;
+// any disagreement means the records are damaged and we rescan. `frame` carries over.
+inline bool decodeNalRecords(const NalIndexRecord* records, size_t count, uint64_t limit, size_t& frame,
+                             std::vector<NalRef>& nals) {
+    for (size_t k = 0; k < count; ++k) {
+        const NalIndexRecord& record = records[k];
+        uint8_t type = static_cast<uint8_t>(record.frame_type & 0x1F);
+        bool first_slice = (record.frame_type & 0x20) != 0;
+        if (record.offset > limit || record.length > limit - record.offset || (record.frame_type >> 6) != frame) {
+            return false;
+        }
+        nals.push_back({record.offset, record.length, type, first_slice});
+        if (type == 1 || type == 5) {
+            nextFrameNumber(nals.back(), frame);
+        }
+    }
+    return true;
+}
+
+inline void encodeNalRecords(const std::vector<NalRef>& nals, std::vector<NalIndexRecord>& records) {
+    records.reserve(records.size() + nals.size());
+    size_t frame = 0;
+    for (const NalRef& nal : nals) {
+        records.push_back({nal.offset, nal.length,
+                           static_cast<uint32_t>(frame << 6) | (nal.first_slice ? 0x20u : 0u) | nal.type});
+        // 1 = P/B, 5 = IDR, the NAL types that advance frame_index
+        if (nal.type == 1 || nal.type == 5) {
+            nextFrameNumber(nal, frame);
+        }
+    }
+}
+
+// Writes the sidecar through a temporary file and a rename, so a concurrent reader never
+// sees half of one. Failing to write it (read-only directory, full disk) is not an error.
+inline bool writeSidecar(const std::string& input_file, const std::vector<std::pair<const void*, size_t>>& parts) {
+    std::string path = nalIndexPath(input_file);
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid()) + "." +
+                           std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    bool ok = true;
+    for (const auto& part : parts) {
+        ok = ok && (part.second == 0 || fwrite(part.first, part.second, 1, f) == 1);
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Loads the sidecar for `input_file` into `nals` if it still describes the mapped data.
+inline bool loadNalIndex(const std::string& input_file, const struct stat& st,
+                         const uint8_t* data, size_t size, std::vector<NalRef>& nals) {
+    FILE* f = fopen(nalIndexPath(input_file).c_str(), "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    size_t max_records = sidecarPayloadSize(f, sizeof(NalIndexHeader)) / sizeof(NalIndexRecord);
+    NalIndexHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.count <= max_records &&
+              nalIndexHeaderMatches(header, kNalIndexMagic, st, data, size);
+
+    std::vector<NalIndexRecord> records;
+    if (ok) {
+        records.resize(header.count);
+        ok = fread(records.data(), sizeof(NalIndexRecord), records.size(), f) == records.size();
+    }
+    fclose(f);
+
+    nals.clear();
+    nals.reserve(records.size());
+    size_t frame = 0;
+    if (!ok || !decodeNalRecords(records.data(), records.size(), size, frame, nals)) {
+        nals.clear();
+        return false;
+    }
+    return true;
+}
+
+inline bool saveNalIndex(const std::string& input_file, const struct stat& st,
+                         const uint8_t* data, size_t size, const std::vector<NalRef>& nals) {
+    NalIndexHeader header = makeNalIndexHeader(st, data, size);
+    header.count = nals.size();
+    std::vector<NalIndexRecord> records;
+    encodeNalRecords(nals, records);
+    return writeSidecar(input_file, {{&header, sizeof(header)},
+                                     {records.data(), records.size() * sizeof(NalIndexRecord)}});
+}
+
+// Loads the packet sidecar of a container input into `index` if it still describes the
+// mapped file. Every sample has to lie inside the file and every NAL inside its packet.
+inline bool loadPacketIndex(const std::string& input_file, const struct stat& st,
+                            const uint8_t* data, size_t size, PacketIndex& index) {
+    FILE* f = fopen(nalIndexPath(input_file).c_str(), "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    size_t payload = sidecarPayloadSize(f, sizeof(PacketIndexHeader));
+    PacketIndexHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              header.file.count <= payload / sizeof(PacketIndexRecord) &&
+              header.nal_count <= (payload - header.file.count * sizeof(PacketIndexRecord)) / sizeof(NalIndexRecord) &&
+              nalIndexHeaderMatches(header.file, kPacketIndexMagic, st, data, size);
+
+    std::vector<NalIndexRecord> records;
+    if (ok) {
+        index.packets.resize(header.file.count);
+        records.resize(header.nal_count);
+        ok = fread(index.packets.data(), sizeof(PacketIndexRecord), index.packets.size(), f) == index.packets.size() &&
+             fread(records.data(), sizeof(NalIndexRecord), records.size(), f) == records.size();
+    }
+    fclose(f);
+
+    index.nals.clear();
+    index.nals.reserve(records.size());
+    size_t next = 0;
+    size_t frame = 0;
+    for (size_t k = 0; ok && k < index.packets.size(); ++k) {
+        const PacketIndexRecord& packet = index.packets[k];
+        ok = packet.pos >= 0 && static_cast<uint64_t>(packet.pos) <= size && packet.size <= size - packet.pos &&
+             packet.nal_count <= records.size() - next &&
+             decodeNalRecords(records.data() + next, packet.nal_count, packet.filtered_size, frame, index.nals);
+        next += ok ? packet.nal_count : 0;
+    }
+    if (!ok || next != records.size()) {
+        index.packets.clear();
+        index.nals.clear();
+        return false;
+    }
+    index.stream_index = header.stream_index;
+    index.time_base_num = header.time_base_num;
+    index.time_base_den = header.time_base_den;
+    return true;
+}
+
+inline bool savePacketIndex(const std::string& input_file, const struct stat& st,
+                            const uint8_t* data, size_t size, const PacketIndex& index) {
+    PacketIndexHeader header;
+    header.file = makeNalIndexHeader(st, data, size, kPacketIndexMagic);
+    header.file.count = index.packets.size();
+    header.stream_index = index.stream_index;
+    header.time_base_num = index.time_base_num;
+    header.time_base_den = index.time_base_den;
+    header.reserved = 0;
+    header.nal_count = index.nals.size();
+    // frame numbers run on across packets, the same way moshNals counts them
+    std::vector<NalIndexRecord> records;
+    encodeNalRecords(index.nals, records);
+    return writeSidecar(input_file, {{&header, sizeof(header)},
+                                     {index.packets.data(), index.packets.size() * sizeof(PacketIndexRecord)},
+                                     {records.data(), records.size() * sizeof(NalIndexRecord)}});
+}
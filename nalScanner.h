@@ -0,0 +1,205 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// One NAL unit inside an Annex B buffer. offset/length cover the start code as well,
+// so [offset, offset + length) is exactly the byte range that gets copied to the output.
+struct NalRef {
+    size_t offset;    // first byte of the start code
+    uint32_t length;  // start code + payload, up to the next start code or the end of the buffer
+    uint8_t type;     // nal_unit_type, the low 5 bits of the NAL header
+    bool first_slice; // a slice (types 1-5) with first_mb_in_slice == 0, i.e. a new picture
+};
+
+// True when `nal` opens a new access unit once the current one already holds a picture:
+// AUD, SEI, SPS, PPS, types 14-18, or the first slice of the next picture (H.264 7.4.1.2.3,
+// without arbitrary slice order).
+inline bool startsAccessUnit(const NalRef& nal) {
+    if (nal.type >= 1 && nal.type <= 5) {
+        return nal.first_slice;
+    }
+    return (nal.type >= 6 && nal.type <= 9) || (nal.type >= 14 && nal.type <= 18);
+}
+
+// Returns the frame number of a frame NAL (1 = P/B, 5 = IDR) and advances frame_index, the
+// number the next picture gets. Every slice of a multi-slice picture shares one number: only
+// a first slice (or a stream that starts mid-picture) opens a new one.
+inline size_t nextFrameNumber(const NalRef& nal, size_t& frame_index) {
+    if (nal.first_slice || frame_index == 0) {
+        return frame_index++;
+    }
+    return frame_index - 1;
+}
+
+// Appends the position of every 00 00 01 sequence that begins in [begin, end) to `out`.
+// A match may read up to two bytes past `end` (never past `size`), which is what lets a
+// caller split a buffer into ranges without losing start codes that straddle them.
+inline void findStartCodes(const uint8_t* data, size_t size, size_t begin, size_t end,
+                           std::vector<size_t>& out) {
+    if (end > size) {
+        end = size;
+    }
+    size_t i = begin;
+
+#if defined(__AVX2__)
+    // compare 32 positions at once: byte i == 0, byte i + 1 == 0, byte i + 2 == 1
+    const __m256i zero32 = _mm256_setzero_si256();
+    const __m256i one32 = _mm256_set1_epi8(1);
+    while (i < end && i + 32 + 2 <= size) {
+        __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 1));
+        __m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 2));
+        __m256i hit = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero32),
+                                                        _mm256_cmpeq_epi8(b1, zero32)),
+                                       _mm256_cmpeq_epi8(b2, one32));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+        if (end - i < 32) {
+            mask &= (1u << (end - i)) - 1;
+        }
+        while (mask) {
+            out.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+        i += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i zero16 = _mm_setzero_si128();
+    const __m128i one16 = _mm_set1_epi8(1);
+    while (i < end && i + 16 + 2 <= size) {
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+        __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 2));
+        __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero16),
+                                                  _mm_cmpeq_epi8(b1, zero16)),
+                                    _mm_cmpeq_epi8(b2, one16));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+        if (end - i < 16) {
+            mask &= (1u << (end - i)) - 1;
+        }
+        while (mask) {
+            out.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+        i += 16;
+    }
+#endif
+
+    // scalar tail (and the whole range without SSE2): let memchr find the 0x01 byte,
+    // then look back for the two zeros in front of it
+    if (i >= end) {
+        return;
+    }
+    size_t limit = end + 2 < size ? end + 2 : size;
+    const uint8_t* p = data + i + 2;
+    while (p < data + limit) {
+        p = static_cast<const uint8_t*>(std::memchr(p, 0x01, (data + limit) - p));
+        if (p == nullptr) {
+            break;
+        }
+        if (p[-1] == 0x00 && p[-2] == 0x00) {
+            out.push_back((p - 2) - data);
+        }
+        ++p;
+    }
+}
+
+// Turns sorted 00 00 01 positions into NAL units. A zero byte in front of the three-byte
+// code makes it a four-byte code, as long as the previous NAL keeps at least its header.
+inline std::vector<NalRef> buildNalIndex(const uint8_t* data, size_t size,
+                                         const std::vector<size_t>& positions) {
+    std::vector<NalRef> nals;
+    nals.reserve(positions.size());
+    size_t prev_payload = 0; // first byte after the previous start code
+
+    for (size_t k = 0; k < positions.size(); ++k) {
+        size_t p = positions[k];
+        size_t start = p;
+        if (p > 0 && data[p - 1] == 0x00 && (nals.empty() || p - 1 > prev_payload)) {
+            start = p - 1;
+        }
+        if (!nals.empty()) {
+            nals.back().length = static_cast<uint32_t>(start - nals.back().offset);
+        }
+        prev_payload = p + 3;
+        // a start code with no header byte after it is not a NAL
+        if (prev_payload >= size) {
+            break;
+        }
+        uint8_t type = static_cast<uint8_t>(data[prev_payload] & 0x1F);
+        // first_mb_in_slice is the first ue(v) of a slice header, and it is 0 exactly when
+        // its leading bit is set
+        bool first_slice = type >= 1 && type <= 5 && prev_payload + 1 < size && (data[prev_payload + 1] & 0x80);
+        nals.push_back({start, 0, type, first_slice});
+    }
+    if (!nals.empty() && nals.back().length == 0) {
+        nals.back().length = static_cast<uint32_t>(size - nals.back().offset);
+    }
+    return nals;
+}
+
+// Indexes every NAL unit in an Annex B buffer. Bytes before the first start code are ignored.
+inline std::vector<NalRef> scanNals(const uint8_t* data, size_t size) {
+    std::vector<size_t> positions;
+    findStartCodes(data, size, 0, size, positions);
+    return buildNalIndex(data, size, positions);
+}
+
+// Below a few MiB per thread the thread start-up costs more than the parallel scan saves
+static const size_t kMinParallelChunk = size_t(4) << 20;
+
+// Threads scanNalsParallel really uses for a buffer: `threads`, capped so that no chunk is
+// smaller than min_chunk. 1 means the scan runs serially.
+inline unsigned parallelScanThreads(size_t size, unsigned threads, size_t min_chunk = kMinParallelChunk) {
+    if (min_chunk == 0) {
+        min_chunk = 1;
+    }
+    if (threads > size / min_chunk) {
+        threads = static_cast<unsigned>(size / min_chunk);
+    }
+    return threads > 1 ? threads : 1;
+}
+
+// Same result as scanNals, but the start-code search is split into `threads` chunks that are
+// scanned concurrently, none smaller than min_chunk (tests pass a tiny one to force
+// chunking). findStartCodes reads past the end of its chunk, so a start code that straddles
+// a boundary is still found, and only by the chunk it begins in. The chunk results are
+// already in order, so joining them and building the index stays a cheap sequential pass.
+inline std::vector<NalRef> scanNalsParallel(const uint8_t* data, size_t size, unsigned threads,
+                                             size_t min_chunk = kMinParallelChunk) {
+    threads = parallelScanThreads(size, threads, min_chunk);
+    if (threads <= 1) {
+        return scanNals(data, size);
+    }
+
+    std::vector<std::vector<size_t>> chunk_positions(threads);
+    std::vector<std::thread> pool;
+    size_t chunk = size / threads;
+    for (unsigned t = 0; t < threads; ++t) {
+        size_t begin = t * chunk;
+        size_t end = t + 1 == threads ? size : begin + chunk;
+        pool.emplace_back([=, &chunk_positions]() {
+            findStartCodes(data, size, begin, end, chunk_positions[t]);
+        });
+    }
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+
+    std::vector<size_t> positions;
+    size_t total = 0;
+    for (const std::vector<size_t>& part : chunk_positions) {
+        total += part.size();
+    }
+    positions.reserve(total);
+    for (const std::vector<size_t>& part : chunk_positions) {
+        positions.insert(positions.end(), part.begin(), part.end());
+    }
+    return buildNalIndex(data, size, positions);
+}
@@ -0,0 +1,110 @@
+// Determinism test for the parallel NAL scan: for several chunk counts the parallel index,
+// and the bytes moshNals + writeSpans produce from it, must match the serial scan exactly.
+// Start codes are planted across every chunk boundary so the stitching is exercised.
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "moshUtil.h"
+#include "nalScanner.h"
+#include "spanWriter.h"
+
+// Runs the filter over `nals` and returns exactly what writeSpans puts in a file
+static std::vector<uint8_t> moshedBytes(const std::vector<uint8_t>& stream, const std::vector<NalRef>& nals,
+                                        const MoshStrategy& strategy) {
+    std::vector<Span> spans;
+    size_t frame_index = 0;
+    moshNals(nals, strategy, frame_index, spans, true, false);
+
+    std::vector<uint8_t> bytes;
+    FILE* f = tmpfile();
+    if (f == nullptr || !writeSpans(fileno(f), stream.data(), spans)) {
+        return bytes;
+    }
+    long size = lseek(fileno(f), 0, SEEK_END);
+    lseek(fileno(f), 0, SEEK_SET);
+    bytes.resize(size > 0 ? static_cast<size_t>(size) : 0);
+    size_t got = 0;
+    while (got < bytes.size()) {
+        ssize_t n = read(fileno(f), bytes.data() + got, bytes.size() - got);
+        if (n <= 0) {
+            break;
+        }
+        got += static_cast<size_t>(n);
+    }
+    bytes.resize(got);
+    fclose(f);
+    return bytes;
+}
+
+// Random payload with frequent zero bytes, NAL headers spread through it, and a start code
+// planted so it begins 0-3 bytes before each boundary of a `chunks`-way split.
+static std::vector<uint8_t> makeStream(size_t size, const std::vector<unsigned>& chunk_counts, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> stream(size);
+    for (uint8_t& byte : stream) {
+        byte = (rng() & 3) == 0 ? 0x00 : static_cast<uint8_t>(rng());
+    }
+    static const uint8_t headers[] = {0x65, 0x41, 0x67, 0x68, 0x06, 0x09, 0x41, 0x41};
+    auto plant = [&](size_t at, bool four_byte) {
+        static const uint8_t code[] = {0x00, 0x00, 0x00, 0x01};
+        size_t len = four_byte ? 4 : 3;
+        if (at + len + 1 > stream.size()) {
+            return;
+        }
+        memcpy(stream.data() + at, code + (4 - len), len);
+        stream[at + len] = headers[rng() % sizeof(headers)];
+    };
+    for (size_t at = 0; at + 64 < size; at += 200 + rng() % 2000) {
+        plant(at, rng() & 1);
+    }
+    for (unsigned chunks : chunk_counts) {
+        size_t chunk = size / chunks;
+        for (unsigned k = 1; k < chunks; ++k) {
+            size_t boundary = k * chunk;
+            plant(boundary - (k % 4), k & 1);
+        }
+    }
+    return stream;
+}
+
+int main() {
+    const std::vector<unsigned> chunk_counts = {2, 3, 4, 7, 8, 16};
+    const size_t min_chunk = 1024;
+    auto iframe_rm = makeMoshStrategy(IFRAMERM, {{3, 40}, {90, 400}}, 1);
+    auto pframe_dup = makeMoshStrategy(PFRAMEDUP, {{10, 30}}, 5);
+    int failures = 0;
+
+    for (uint32_t seed : {1u, 2u, 3u}) {
+        for (size_t size : {size_t(64) << 10, (size_t(1) << 20) + 7}) {
+            std::vector<uint8_t> stream = makeStream(size, chunk_counts, seed);
+            std::vector<NalRef> serial = scanNals(stream.data(), stream.size());
+
+            for (unsigned chunks : chunk_counts) {
+                std::vector<NalRef> parallel = scanNalsParallel(stream.data(), stream.size(), chunks, min_chunk);
+                bool same_index = parallel.size() == serial.size();
+                for (size_t k = 0; same_index && k < serial.size(); ++k) {
+                    same_index = parallel[k].offset == serial[k].offset &&
+                                 parallel[k].length == serial[k].length && parallel[k].type == serial[k].type;
+                }
+
+                for (const MoshStrategy* strategy : {iframe_rm.get(), pframe_dup.get()}) {
+                    std::vector<uint8_t> expected = moshedBytes(stream, serial, *strategy);
+                    std::vector<uint8_t> actual = moshedBytes(stream, parallel, *strategy);
+                    bool same_bytes = !expected.empty() && expected.size() == actual.size() &&
+                                      memcmp(expected.data(), actual.data(), expected.size()) == 0;
+                    if (!same_index || !same_bytes) {
+                        printf("FAIL seed %u, %zu bytes, %u chunks: index %s, output %s\n", seed, size, chunks,
+                               same_index ? "matches" : "differs", same_bytes ? "matches" : "differs");
+                        ++failures;
+                    }
+                }
+            }
+        }
+    }
+    if (failures == 0) {
+        printf("parallel scan output matches the serial scan\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
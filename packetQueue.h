@@ -0,0 +1,104 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+extern "C" {
+    #include <libavcodec/avcodec.h>
+}
+
+// Fixed-size ring of demuxed packets between the reader thread and the mosh/mux thread of a
+// live stream. push() blocks while the ring is full, so a slow consumer stops the reader and
+// the back-pressure reaches whatever is feeding the pipe; memory never grows past capacity
+// packets however long the stream runs.
+class PacketQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit PacketQueue(size_t capacity) : slots_(capacity == 0 ? 1 : capacity) {
+        for (Slot& slot : slots_) {
+            slot.pkt = av_packet_alloc();
+        }
+    }
+    PacketQueue(const PacketQueue&) = delete;
+    PacketQueue& operator=(const PacketQueue&) = delete;
+    ~PacketQueue() {
+        for (Slot& slot : slots_) {
+            av_packet_free(&slot.pkt);
+        }
+    }
+
+    // Moves pkt's reference into the ring. Returns false once the queue has been closed.
+    bool push(AVPacket* pkt) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (count_ == slots_.size() && !closed_) {
+            Clock::time_point start = Clock::now();
+            not_full_.wait(lock, [this] { return count_ < slots_.size() || closed_; });
+            blocked_ += Clock::now() - start;
+        }
+        if (closed_) {
+            av_packet_unref(pkt);
+            return false;
+        }
+        Slot& slot = slots_[(head_ + count_) % slots_.size()];
+        av_packet_move_ref(slot.pkt, pkt);
+        slot.queued = Clock::now();
+        ++count_;
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Moves the oldest packet into pkt and reports when it was queued. Returns false once the
+    // queue is closed and drained.
+    bool pop(AVPacket* pkt, Clock::time_point& queued) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return count_ > 0 || closed_; });
+        if (count_ == 0) {
+            return false;
+        }
+        Slot& slot = slots_[head_];
+        av_packet_move_ref(pkt, slot.pkt);
+        queued = slot.queued;
+        head_ = (head_ + 1) % slots_.size();
+        --count_;
+        not_full_.notify_one();
+        return true;
+    }
+
+    // End of input from the reader, or an abort from the consumer. Packets already queued
+    // can still be popped.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return count_;
+    }
+    size_t capacity() const { return slots_.size(); }
+
+    // total time the reader spent waiting on a full ring
+    Clock::duration blockedTime() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return blocked_;
+    }
+
+private:
+    struct Slot {
+        AVPacket* pkt = nullptr;
+        Clock::time_point queued;
+    };
+
+    std::vector<Slot> slots_;
+    size_t head_ = 0;
+    size_t count_ = 0;
+    bool closed_ = false;
+    Clock::duration blocked_{0};
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
@@ -0,0 +1,119 @@
+#pragma once
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// A byte range of the source buffer that ends up in the output. The moshed stream is
+// described as a list of these instead of a second copy of the bytes.
+struct Span {
+    size_t offset;
+    size_t length;
+};
+
+// Appends a span, merging it into the previous one when they touch. Runs of kept NALs
+// collapse into one span, so a packet that loses nothing stays a single range.
+inline void appendSpan(std::vector<Span>& spans, size_t offset, size_t length) {
+    if (!spans.empty() && spans.back().offset + spans.back().length == offset) {
+        spans.back().length += length;
+    } else {
+        spans.push_back({offset, length});
+    }
+}
+
+// Writes every span of `base` to `fd` with writev, IOV_MAX entries at a time.
+// Returns false on a write error (errno is left set).
+inline bool writeSpans(int fd, const uint8_t* base, const std::vector<Span>& spans) {
+    std::vector<iovec> iov;
+    iov.reserve(spans.size() < IOV_MAX ? spans.size() : IOV_MAX);
+    size_t k = 0;
+
+    while (k < spans.size()) {
+        iov.clear();
+        for (; k < spans.size() && iov.size() < IOV_MAX; ++k) {
+            iov.push_back({const_cast<uint8_t*>(base + spans[k].offset), spans[k].length});
+        }
+        // writev may stop short, so keep going from wherever it left off
+        size_t first = 0;
+        while (first < iov.size()) {
+            ssize_t written = writev(fd, iov.data() + first, static_cast<int>(iov.size() - first));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            size_t left = static_cast<size_t>(written);
+            while (first < iov.size() && left >= iov[first].iov_len) {
+                left -= iov[first].iov_len;
+                ++first;
+            }
+            if (left > 0) {
+                iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + left;
+                iov[first].iov_len -= left;
+            }
+        }
+    }
+    return true;
+}
+
+// Read-only mmap of a whole file. Pages are only faulted in as the scanner touches them.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        data_ = static_cast<const uint8_t*>(addr);
+        size_ = static_cast<size_t>(st.st_size);
+        stat_ = st;
+        return true;
+    }
+
+    void close() {
+        if (data_ != nullptr) {
+            munmap(const_cast<uint8_t*>(data_), size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    // the fstat taken when the file was mapped
+    const struct stat& fileStat() const { return stat_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    struct stat stat_ = {};
+};